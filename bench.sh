@@ -0,0 +1,133 @@
+#!/bin/bash
+# bench.sh - throughput and latency of sender/receiver over loopback
+#
+# Runs every combination of file size, window, payload, emulated loss and
+# congestion controller RUNS times and prints one line per combination, as
+# CSV or JSON, on stdout; progress goes to stderr. Failed transfers are counted, not fatal.
+# Everything is set from the environment (make bench passes its variables):
+#
+#   SIZES      file sizes, as head -c takes them     (1M 16M)
+#   WINDOWS    sender windows in packets             (64 256 1024)
+#   PAYLOADS   DATA payloads in bytes                (1024 8900)
+#   LOSSES     loss probability of both directions   (0 0.001 0.01 0.05)
+#   CCS        congestion controllers, sender -C     (cubic none)
+#   RUNS       transfers per combination             (5)
+#   FORMAT     csv or json                           (csv)
+#   SENDER_OPTS, RECEIVER_OPTS  more options for the programs
+#   DIR        where the files go                    (/tmp/gbn-bench)
+#   TIMEOUT    seconds before a transfer is failed   (120)
+#
+# Columns: the commit, the combination, runs and failures, goodput of the
+# median run (Mbit/s), completion time percentiles (ms), means of the
+# sender's retransmissions, timeouts, duplicate ACKs and fast retransmits
+# (its -v statistics)
+# and mean CPU time of sender and receiver (ms).
+
+SIZES=${SIZES:-"1M 16M"}
+WINDOWS=${WINDOWS:-"64 256 1024"}
+PAYLOADS=${PAYLOADS:-"1024 8900"}
+LOSSES=${LOSSES:-"0 0.001 0.01 0.05"}
+CCS=${CCS:-"cubic none"}
+RUNS=${RUNS:-5}
+FORMAT=${FORMAT:-csv}
+DIR=${DIR:-/tmp/gbn-bench}
+TIMEOUT=${TIMEOUT:-120}
+
+cd "$(dirname "$0")"
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+mkdir -p "$DIR" || exit 1
+port=$((20000 + RANDOM % 20000))
+TIMEFORMAT='%3R %3U %3S'
+
+# nearest rank percentile $1 of the numbers on stdin
+percentile()
+{
+	sort -n | awk -v p="$1" '{ v[NR] = $1 } END { if (NR == 0) { print "nan"; exit }
+		i = int(p * NR / 100); if (i < p * NR / 100) i++; if (i < 1) i = 1; print v[i] }'
+}
+
+mean()
+{
+	awk '{ s += $1 } END { if (NR == 0) print "nan"; else printf "%.1f\n", s / NR }'
+}
+
+# one transfer, appends "time_ms retransmits timeouts dup_acks fast_retransmits
+# sender_cpu_ms receiver_cpu_ms" to $runs
+transfer()
+{
+	local file=$1 size=$2 window=$3 payload=$4 loss=$5 cc=$6
+	local out=$DIR/out rc rrc
+
+	rm -f "$out"
+	port=$((port + 1))
+	export GBN_IMPAIR="loss=$loss"
+	{ time timeout "$TIMEOUT" ./receiver -l "$payload" $RECEIVER_OPTS $port "$out" 2>"$DIR/receiver.log" ; } 2>"$DIR/receiver.time" &
+	local rp=$!
+	sleep 0.1
+	{ time timeout "$TIMEOUT" ./sender -v -w "$window" -l "$payload" -C "$cc" $SENDER_OPTS 127.0.0.1 $port "$file" 2>"$DIR/sender.log" ; } 2>"$DIR/sender.time"
+	rc=$?
+	wait $rp
+	rrc=$?
+	unset GBN_IMPAIR
+	if [ $rc -ne 0 ] || [ $rrc -ne 0 ] || ! cmp -s "$file" "$out"; then
+		echo "FAIL size=$size window=$window payload=$payload loss=$loss cc=$cc" >&2
+		failures=$((failures + 1))
+		return
+	fi
+	read real suser ssys < "$DIR/sender.time"
+	read rreal ruser rsys < "$DIR/receiver.time"
+	awk -v r="$real" -v su="$suser" -v ss="$ssys" -v ru="$ruser" -v rs="$rsys" '
+		/^stats: sender pkts_sent=/ {
+			for (i = 3; i <= NF; i++) { split($i, kv, "="); st[kv[1]] = kv[2] }
+		}
+		END {
+			printf "%.1f %d %d %d %d %.0f %.0f\n", r * 1000, st["retransmits"], st["timeouts"],
+				st["dup_acks"], st["fast_retransmits"], (su + ss) * 1000, (ru + rs) * 1000 }' "$DIR/sender.log" >> "$runs"
+}
+
+rows=$DIR/rows
+runs=$DIR/runs
+: > "$rows"
+for size in $SIZES; do
+	file=$DIR/in.$size
+	[ -f "$file" ] || head -c "$size" /dev/urandom > "$file" || exit 1
+	bytes=$(stat -c%s "$file")
+	for window in $WINDOWS; do
+		for payload in $PAYLOADS; do
+			for loss in $LOSSES; do
+			for cc in $CCS; do
+				echo "size=$size window=$window payload=$payload loss=$loss cc=$cc" >&2
+				: > "$runs"
+				failures=0
+				for i in $(seq "$RUNS"); do
+					transfer "$file" "$bytes" "$window" "$payload" "$loss" "$cc"
+				done
+				p50=$(cut -d' ' -f1 "$runs" | percentile 50)
+				echo "$commit,$bytes,$window,$payload,$loss,$cc,$RUNS,$failures," \
+				     "$(awk -v b="$bytes" -v t="$p50" 'BEGIN { if (t + 0 > 0) printf "%.1f", b * 8 / t / 1000; else print "nan" }')," \
+				     "$p50,$(cut -d' ' -f1 "$runs" | percentile 90),$(cut -d' ' -f1 "$runs" | percentile 99)," \
+				     "$(cut -d' ' -f1 "$runs" | sort -n | tail -1)," \
+				     "$(cut -d' ' -f2 "$runs" | mean),$(cut -d' ' -f3 "$runs" | mean),$(cut -d' ' -f4 "$runs" | mean)," \
+				     "$(cut -d' ' -f5 "$runs" | mean),$(cut -d' ' -f6 "$runs" | mean),$(cut -d' ' -f7 "$runs" | mean)" |
+					tr -d ' ' >> "$rows"
+			done
+			done
+		done
+	done
+done
+
+header="commit,bytes,window,payload,loss,cc,runs,failures,goodput_mbps,time_p50_ms,time_p90_ms,time_p99_ms,time_max_ms,retransmits,timeouts,dup_acks,fast_retransmits,sender_cpu_ms,receiver_cpu_ms"
+if [ "$FORMAT" = json ]; then
+	awk -F, -v h="$header" 'BEGIN { n = split(h, k, ","); print "[" }
+		{ printf "%s  {", (NR > 1 ? ",\n" : "")
+		  for (i = 1; i <= n; i++) {
+			v = $i
+			if (i == 1 || i == 6 || v == "nan" || v == "") v = "\"" v "\""
+			printf "%s\"%s\": %s", (i > 1 ? ", " : ""), k[i], v
+		  }
+		  printf "}" }
+		END { print "\n]" }' "$rows"
+else
+	echo "$header"
+	cat "$rows"
+fi
@@ -0,0 +1,135 @@
+#include "gbn.h"
+#include "cc.h"
+#include <math.h>
+
+/* slow start until ssthresh, shared by both controllers */
+static int slow_start(struct cc_state* cc, uint32_t acked){
+    if (cc->cwnd < cc->ssthresh){
+        cc->cwnd += acked;
+        return 1;
+    }
+    return 0;
+}
+
+static void init_common(struct cc_state* cc){
+    cc->cwnd = CC_INIT_CWND;
+    cc->ssthresh = MAXWIN;
+    cc->w_max = 0;
+    cc->w_est = 0;
+    cc->k = 0;
+    cc->epoch = 0;
+}
+
+/*----- fixed window, only GBN_WINDOW limits the sender -----*/
+static void none_init(struct cc_state* cc){
+    cc->cwnd = MAXWIN;
+    cc->ssthresh = MAXWIN;
+}
+
+static void none_on_ack(struct cc_state* cc, uint32_t acked, uint32_t srtt, uint64_t now){
+    /* gbn_send() clamps the window to GBN_WINDOW, which may grow later */
+    cc->cwnd = MAXWIN;
+}
+
+static void none_on_event(struct cc_state* cc, uint64_t now){
+}
+
+/*----- Reno: slow start, then one packet more per window, half on loss -----*/
+static void reno_on_ack(struct cc_state* cc, uint32_t acked, uint32_t srtt, uint64_t now){
+    if (!slow_start(cc, acked)){
+        cc->cwnd += (double)acked / cc->cwnd;
+    }
+}
+
+static void reno_on_loss(struct cc_state* cc, uint64_t now){
+    cc->ssthresh = cc->cwnd / 2 > CC_MIN_CWND ? cc->cwnd / 2 : CC_MIN_CWND;
+    cc->cwnd = cc->ssthresh;
+}
+
+static void reno_on_timeout(struct cc_state* cc, uint64_t now){
+    reno_on_loss(cc, now);
+    cc->cwnd = 1;
+}
+
+/*----- CUBIC (RFC 8312): the window grows as a cubic function of the time -----*/
+/* since the last loss, flat around the window it had then, so it gets back */
+/* there fast and only probes beyond it carefully */
+#define CUBIC_C    0.4
+#define CUBIC_BETA 0.7
+
+static void cubic_on_ack(struct cc_state* cc, uint32_t acked, uint32_t srtt, uint64_t now){
+    double t, d, target;
+    if (slow_start(cc, acked)){
+        return;
+    }
+    if (cc->epoch == 0){
+        cc->epoch = now;
+        if (cc->cwnd < cc->w_max){
+            cc->k = cbrt((cc->w_max - cc->cwnd) / CUBIC_C);
+        }
+        else {
+            cc->k = 0;
+            cc->w_max = cc->cwnd;
+        }
+        cc->w_est = cc->cwnd;
+    }
+    /* where the curve is one RTT from now */
+    t = (now - cc->epoch + srtt) / 1e6;
+    d = t - cc->k;
+    target = CUBIC_C * d * d * d + cc->w_max;
+    if (target > 1.5 * cc->cwnd){
+        target = 1.5 * cc->cwnd;
+    }
+    if (target > cc->cwnd){
+        cc->cwnd += (target - cc->cwnd) / cc->cwnd * acked;
+    }
+    else {
+        cc->cwnd += 0.01 * acked / cc->cwnd;
+    }
+    /* never slower than Reno would be on the same path */
+    cc->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / cc->cwnd;
+    if (cc->w_est > cc->cwnd){
+        cc->cwnd = cc->w_est;
+    }
+}
+
+static void cubic_on_loss(struct cc_state* cc, uint64_t now){
+    cc->epoch = 0;
+    /* losing again below the last maximum: give way to other flows */
+    if (cc->cwnd < cc->w_max){
+        cc->w_max = cc->cwnd * (1 + CUBIC_BETA) / 2;
+    }
+    else {
+        cc->w_max = cc->cwnd;
+    }
+    cc->cwnd = cc->cwnd * CUBIC_BETA > CC_MIN_CWND ? cc->cwnd * CUBIC_BETA : CC_MIN_CWND;
+    cc->ssthresh = cc->cwnd;
+}
+
+static void cubic_on_timeout(struct cc_state* cc, uint64_t now){
+    cubic_on_loss(cc, now);
+    cc->cwnd = 1;
+}
+
+static const struct cc_ops cc_none = {
+    "none", none_init, none_on_ack, none_on_event, none_on_event
+};
+static const struct cc_ops cc_reno = {
+    "reno", init_common, reno_on_ack, reno_on_loss, reno_on_timeout
+};
+static const struct cc_ops cc_cubic = {
+    "cubic", init_common, cubic_on_ack, cubic_on_loss, cubic_on_timeout
+};
+
+const struct cc_ops* cc_find(int id){
+    switch (id){
+        case GBN_CC_NONE:
+            return &cc_none;
+        case GBN_CC_RENO:
+            return &cc_reno;
+        case GBN_CC_CUBIC:
+            return &cc_cubic;
+        default:
+            return NULL;
+    }
+}
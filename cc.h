@@ -0,0 +1,34 @@
+#ifndef GBN_CC_H
+#define GBN_CC_H
+
+#include <stdint.h>
+
+/* congestion control state of a sending connection, windows in packets */
+struct cc_state {
+    const struct cc_ops* ops;
+    double cwnd;              /* congestion window                          */
+    double ssthresh;          /* slow start threshold                       */
+    double w_max;             /* CUBIC: window before the last reduction    */
+    double w_est;             /* CUBIC: what Reno would have by now         */
+    double k;                 /* CUBIC: seconds to grow back to w_max       */
+    uint64_t epoch;           /* CUBIC: start of the growth period (usec)   */
+};
+
+/* a congestion controller, gbn_send() calls it when packets are newly */
+/* ACK'd, when a loss is detected while data still flows, and when the */
+/* retransmission timer fires */
+struct cc_ops {
+    const char* name;
+    void (*init)(struct cc_state* cc);
+    void (*on_ack)(struct cc_state* cc, uint32_t acked, uint32_t srtt, uint64_t now);
+    void (*on_loss)(struct cc_state* cc, uint64_t now);
+    void (*on_timeout)(struct cc_state* cc, uint64_t now);
+};
+
+#define CC_INIT_CWND  10      /* initial window (packets), RFC 6928       */
+#define CC_MIN_CWND    2      /* window after a loss never drops below    */
+
+/* controller for a GBN_CC_* id, NULL if there is none */
+const struct cc_ops* cc_find(int id);
+
+#endif
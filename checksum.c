@@ -0,0 +1,194 @@
+#include "checksum.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* the kernels are picked once, on first use, from what the CPU supports. */
+/* GBN_CSUM=scalar in the environment forces the portable ones */
+static uint32_t (*csum_kernel)(const uint8_t*, size_t, uint32_t);
+static uint32_t (*crc_kernel)(uint32_t, const uint8_t*, size_t);
+static void (*xor_kernel)(uint8_t*, const uint8_t*, size_t);
+static const char* csum_name;
+static const char* crc_name;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/* portable Internet checksum, one big endian word at a time */
+static uint32_t csum_scalar(const uint8_t* p, size_t len, uint32_t sum){
+    size_t i;
+    for (i = 0; i + 1 < len; i += 2)
+        sum += ((uint32_t)p[i] << 8) + p[i + 1];
+    if (len & 1)
+        sum += (uint32_t)p[len - 1] << 8;
+    return sum;
+}
+
+/* the one's complement sum doesn't depend on byte order (RFC 1071): the */
+/* vector kernels add little endian words and swap the folded result */
+static uint32_t swap_folded(uint64_t total){
+    while (total >> 16)
+        total = (total & 0xffff) + (total >> 16);
+    return ((total & 0xff) << 8) | (total >> 8);
+}
+
+/* 32 bit lanes take 2 words per round, flush them long before they overflow */
+#define LANE_ROUNDS 16384
+
+#if defined(__x86_64__)
+__attribute__((target("sse2")))
+static uint32_t csum_sse2(const uint8_t* p, size_t len, uint32_t sum){
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t total = 0;
+    uint32_t lanes[4];
+    int i;
+    while (len >= 16){
+        __m128i acc = zero;
+        int rounds = 0;
+        for (; len >= 16 && rounds < LANE_ROUNDS; rounds++, p += 16, len -= 16){
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+        }
+        _mm_storeu_si128((__m128i*)lanes, acc);
+        for (i = 0; i < 4; i++)
+            total += lanes[i];
+    }
+    /* the tail starts on an even offset, so its words line up */
+    return csum_scalar(p, len, sum + swap_folded(total));
+}
+
+__attribute__((target("avx2")))
+static uint32_t csum_avx2(const uint8_t* p, size_t len, uint32_t sum){
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t total = 0;
+    uint32_t lanes[8];
+    int i;
+    while (len >= 32){
+        __m256i acc = zero;
+        int rounds = 0;
+        for (; len >= 32 && rounds < LANE_ROUNDS; rounds++, p += 32, len -= 32){
+            __m256i v = _mm256_loadu_si256((const __m256i*)p);
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+        }
+        _mm256_storeu_si256((__m256i*)lanes, acc);
+        for (i = 0; i < 8; i++)
+            total += lanes[i];
+    }
+    return csum_sse2(p, len, sum + swap_folded(total));
+}
+#endif
+
+/* table driven CRC32C, reflected polynomial 0x82f63b78 */
+static uint32_t crc_table[256];
+
+static uint32_t crc_scalar(uint32_t crc, const uint8_t* p, size_t len){
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const uint8_t* p, size_t len){
+    uint64_t c = crc, v;
+    for (; len >= 8; p += 8, len -= 8){
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+/* parity of forward error correction, a word at a time */
+static void xor_scalar(uint8_t* dst, const uint8_t* src, size_t len){
+    uint64_t d, v;
+    for (; len >= 8; dst += 8, src += 8, len -= 8){
+        memcpy(&d, dst, sizeof(d));
+        memcpy(&v, src, sizeof(v));
+        d ^= v;
+        memcpy(dst, &d, sizeof(d));
+    }
+    while (len--)
+        *dst++ ^= *src++;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse2")))
+static void xor_sse2(uint8_t* dst, const uint8_t* src, size_t len){
+    for (; len >= 16; dst += 16, src += 16, len -= 16){
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)dst),
+                                  _mm_loadu_si128((const __m128i*)src));
+        _mm_storeu_si128((__m128i*)dst, v);
+    }
+    xor_scalar(dst, src, len);
+}
+#endif
+
+static void kernels_init(void){
+    const char* force = getenv("GBN_CSUM");
+    uint32_t i, j, c;
+    for (i = 0; i < 256; i++){
+        for (c = i, j = 0; j < 8; j++)
+            c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+        crc_table[i] = c;
+    }
+    csum_kernel = csum_scalar;
+    csum_name = "scalar";
+    crc_kernel = crc_scalar;
+    crc_name = "scalar";
+    xor_kernel = xor_scalar;
+#if defined(__x86_64__)
+    if (force != NULL && strcmp(force, "scalar") == 0)
+        return;
+    __builtin_cpu_init();
+    /* SSE2 is part of x86-64 */
+    csum_kernel = csum_sse2;
+    csum_name = "sse2";
+    xor_kernel = xor_sse2;
+    if (__builtin_cpu_supports("avx2") && (force == NULL || strcmp(force, "sse2") != 0)){
+        csum_kernel = csum_avx2;
+        csum_name = "avx2";
+    }
+    if (__builtin_cpu_supports("sse4.2")){
+        crc_kernel = crc_sse42;
+        crc_name = "sse4.2";
+    }
+#endif
+}
+
+uint32_t csum_partial(const void* buf, size_t len, uint32_t sum){
+    pthread_once(&kernels_once, kernels_init);
+    return csum_kernel(buf, len, sum);
+}
+
+uint16_t csum_fold(uint32_t sum){
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+    return ~sum;
+}
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len){
+    pthread_once(&kernels_once, kernels_init);
+    return ~crc_kernel(~crc, buf, len);
+}
+
+void xor_bytes(void* dst, const void* src, size_t len){
+    pthread_once(&kernels_once, kernels_init);
+    xor_kernel(dst, src, len);
+}
+
+const char* csum_impl(void){
+    pthread_once(&kernels_once, kernels_init);
+    return csum_name;
+}
+
+const char* crc32c_impl(void){
+    pthread_once(&kernels_once, kernels_init);
+    return crc_name;
+}
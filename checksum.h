@@ -0,0 +1,24 @@
+#ifndef GBN_CHECKSUM_H
+#define GBN_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* adds the big endian 16 bit words of buf to sum, an odd last byte is */
+/* zero padded. The result is not folded, buffers up to 64KB can't overflow */
+uint32_t csum_partial(const void* buf, size_t len, uint32_t sum);
+
+/* folds a sum of csum_partial() to 16 bits and complements it */
+uint16_t csum_fold(uint32_t sum);
+
+/* CRC32C (Castagnoli) of buf continuing from crc, start with 0 */
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+/* dst ^= src over len bytes, the parity of forward error correction */
+void xor_bytes(void* dst, const void* src, size_t len);
+
+/* names of the kernels picked for this CPU, for logs and benchmarks */
+const char* csum_impl(void);
+const char* crc32c_impl(void);
+
+#endif
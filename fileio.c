@@ -0,0 +1,429 @@
+#include "fileio.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define REQ_FREE    0
+#define REQ_QUEUED  1         /* threads: waiting for a worker               */
+#define REQ_BUSY    2         /* being read or written                       */
+#define REQ_DONE    3
+
+/* one block and the I/O on it */
+struct fio_req {
+    char* buf;
+    struct iovec iov;         /* the part of buf being read or written       */
+    off_t off;
+    ssize_t res;              /* bytes transferred or -errno                 */
+    int state;
+};
+
+/* the rings shared with the kernel, there is no liburing to hide them */
+struct uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+struct fio {
+    int fd;
+    int writing;
+    int flags;
+    int depth;
+    size_t bsize;
+    off_t off;                /* file offset of the next request             */
+    off_t size;               /* reader: length of the file                  */
+    struct fio_req* reqs;     /* depth blocks, used round robin              */
+    int head;                 /* oldest request in flight                    */
+    int count;                /* requests in flight                          */
+    int held;                 /* reader: the caller has the block before head */
+    int err;                  /* errno of the first failed request           */
+    int uring;                /* io_uring, else the thread pool              */
+    struct uring ring;
+    pthread_t* threads;
+    pthread_mutex_t lock;     /* threads: guards the states of the requests  */
+    pthread_cond_t cond;
+    int stop;
+};
+
+/*----- io_uring through the raw system calls -----*/
+static int ring_init(struct uring* q, unsigned entries){
+#ifdef __NR_io_uring_setup
+    struct io_uring_params p;
+    char* sq;
+    char* cq;
+
+    memset(&p, 0, sizeof(p));
+    q->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (q->fd == -1)
+        return -1;
+    q->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    q->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    q->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    q->sq_ring = mmap(NULL, q->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      q->fd, IORING_OFF_SQ_RING);
+    q->cq_ring = mmap(NULL, q->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      q->fd, IORING_OFF_CQ_RING);
+    q->sqes = mmap(NULL, q->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   q->fd, IORING_OFF_SQES);
+    if (q->sq_ring == MAP_FAILED || q->cq_ring == MAP_FAILED || q->sqes == MAP_FAILED){
+        if (q->sq_ring != MAP_FAILED)
+            munmap(q->sq_ring, q->sq_len);
+        if (q->cq_ring != MAP_FAILED)
+            munmap(q->cq_ring, q->cq_len);
+        if (q->sqes != MAP_FAILED)
+            munmap(q->sqes, q->sqes_len);
+        close(q->fd);
+        return -1;
+    }
+    sq = q->sq_ring;
+    cq = q->cq_ring;
+    q->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    q->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    q->sq_array = (unsigned*)(sq + p.sq_off.array);
+    q->cq_head = (unsigned*)(cq + p.cq_off.head);
+    q->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    q->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void ring_free(struct uring* q){
+    munmap(q->sqes, q->sqes_len);
+    munmap(q->cq_ring, q->cq_len);
+    munmap(q->sq_ring, q->sq_len);
+    close(q->fd);
+}
+
+static int ring_enter(struct uring* q, unsigned submit, unsigned wait){
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, q->fd, submit, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+    return ret;
+}
+
+/* at most depth requests are in flight, the SQ ring never fills up */
+static int ring_submit(struct fio* f, int slot){
+    struct uring* q = &f->ring;
+    struct fio_req* r = &f->reqs[slot];
+    unsigned tail = *q->sq_tail;
+    unsigned idx = tail & *q->sq_mask;
+    struct io_uring_sqe* sqe = &q->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = f->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = f->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&r->iov;
+    sqe->len = 1;
+    sqe->off = r->off;
+    sqe->user_data = slot;
+    q->sq_array[idx] = idx;
+    __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return ring_enter(q, 1, 0) == -1 ? -1 : 0;
+}
+
+/* marks the next completion done, waiting for one if there is none */
+static int ring_reap(struct fio* f){
+    struct uring* q = &f->ring;
+    unsigned head = *q->cq_head;
+    struct io_uring_cqe* cqe;
+
+    while (head == __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE)){
+        if (ring_enter(q, 0, 1) == -1)
+            return -1;
+    }
+    cqe = &q->cqes[head & *q->cq_mask];
+    f->reqs[cqe->user_data].res = cqe->res;
+    f->reqs[cqe->user_data].state = REQ_DONE;
+    __atomic_store_n(q->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*----- The thread pool, for kernels without io_uring -----*/
+static void* worker(void* arg){
+    struct fio* f = arg;
+    struct fio_req* r;
+    ssize_t n;
+    int i;
+
+    pthread_mutex_lock(&f->lock);
+    while (1){
+        /* the queued request closest to the start of the file */
+        r = NULL;
+        for (i = 0; i < f->depth; i++){
+            if (f->reqs[i].state == REQ_QUEUED && (r == NULL || f->reqs[i].off < r->off))
+                r = &f->reqs[i];
+        }
+        if (r == NULL){
+            if (f->stop)
+                break;
+            pthread_cond_wait(&f->cond, &f->lock);
+            continue;
+        }
+        r->state = REQ_BUSY;
+        pthread_mutex_unlock(&f->lock);
+        if (f->writing)
+            n = pwrite(f->fd, r->iov.iov_base, r->iov.iov_len, r->off);
+        else
+            n = pread(f->fd, r->iov.iov_base, r->iov.iov_len, r->off);
+        pthread_mutex_lock(&f->lock);
+        r->res = n == -1 ? -errno : n;
+        r->state = REQ_DONE;
+        pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return NULL;
+}
+
+/*----- Requests -----*/
+/* queues the block at slot for len bytes at the current offset */
+static void submit(struct fio* f, int slot, size_t len){
+    struct fio_req* r = &f->reqs[slot];
+
+    r->iov.iov_base = r->buf;
+    r->iov.iov_len = len;
+    r->off = f->off;
+    r->res = 0;
+    f->off += len;
+    f->count++;
+    if (f->uring){
+        r->state = REQ_BUSY;
+        if (ring_submit(f, slot) == -1){
+            r->res = -errno;
+            r->state = REQ_DONE;
+        }
+        return;
+    }
+    pthread_mutex_lock(&f->lock);
+    r->state = REQ_QUEUED;
+    pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* waits for the oldest request and retires it, short transfers are */
+/* finished here. Returns it, with res the bytes of the whole block */
+static struct fio_req* retire(struct fio* f){
+    struct fio_req* r = &f->reqs[f->head];
+    size_t want = r->iov.iov_len;
+    ssize_t n;
+
+    if (f->uring){
+        while (r->state != REQ_DONE){
+            if (ring_reap(f) == -1){
+                r->res = -errno;
+                break;
+            }
+        }
+    }
+    else {
+        pthread_mutex_lock(&f->lock);
+        while (r->state != REQ_DONE)
+            pthread_cond_wait(&f->cond, &f->lock);
+        pthread_mutex_unlock(&f->lock);
+    }
+    /* reads ask for whole blocks, the last one ends with the file */
+    if (!f->writing && f->size - r->off < (off_t)want)
+        want = f->size - r->off;
+    while (r->res >= 0 && (size_t)r->res < want){
+        if (f->writing)
+            n = pwrite(f->fd, r->buf + r->res, want - r->res, r->off + r->res);
+        else
+            n = pread(f->fd, r->buf + r->res, want - r->res, r->off + r->res);
+        if (n == -1)
+            r->res = -errno;
+        else if (n == 0)
+            break;
+        else
+            r->res += n;
+    }
+    if (r->res < 0 && f->err == 0)
+        f->err = -r->res;
+    r->state = REQ_FREE;
+    f->head = (f->head + 1) % f->depth;
+    f->count--;
+    return r;
+}
+
+/* reader: reads the next block of the file into the free slot */
+static void read_ahead(struct fio* f){
+    while (f->count + f->held < f->depth && f->off < f->size)
+        submit(f, (f->head + f->count) % f->depth, f->bsize);
+}
+
+/* O_DIRECT needs aligned lengths, the tail of a file goes through the cache */
+static int set_direct(int fd, int on){
+    int fl = fcntl(fd, F_GETFL);
+    if (fl == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, on ? fl | O_DIRECT : fl & ~O_DIRECT);
+}
+
+struct fio* fio_open(int fd, int writing, size_t blocksize, int depth, int flags){
+    struct fio* f;
+    struct stat st;
+    int i;
+
+    if (depth < 1 || blocksize == 0 || blocksize % FIO_ALIGN != 0){
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!writing && fstat(fd, &st) == -1)
+        return NULL;
+    if ((flags & FIO_DIRECT) && set_direct(fd, 1) == -1)
+        return NULL;
+    if ((f = calloc(1, sizeof(struct fio))) == NULL)
+        return NULL;
+    f->fd = fd;
+    f->writing = writing;
+    f->flags = flags;
+    f->depth = depth;
+    f->bsize = blocksize;
+    f->size = writing ? 0 : st.st_size;
+    if ((f->reqs = calloc(depth, sizeof(struct fio_req))) == NULL){
+        free(f);
+        return NULL;
+    }
+    for (i = 0; i < depth; i++){
+        if (posix_memalign((void**)&f->reqs[i].buf, FIO_ALIGN, blocksize) != 0){
+            while (i-- > 0)
+                free(f->reqs[i].buf);
+            free(f->reqs);
+            free(f);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    /* containers often filter io_uring out, the threads do the same job */
+    if ((flags & FIO_URING) && ring_init(&f->ring, depth) == 0)
+        f->uring = 1;
+    else {
+        pthread_mutex_init(&f->lock, NULL);
+        pthread_cond_init(&f->cond, NULL);
+        f->threads = malloc(depth * sizeof(pthread_t));
+        for (i = 0; i < depth; i++){
+            if (f->threads == NULL || pthread_create(&f->threads[i], NULL, worker, f) != 0){
+                f->stop = 1;
+                pthread_cond_broadcast(&f->cond);
+                while (i-- > 0)
+                    pthread_join(f->threads[i], NULL);
+                for (i = 0; i < depth; i++)
+                    free(f->reqs[i].buf);
+                free(f->threads);
+                free(f->reqs);
+                free(f);
+                errno = EAGAIN;
+                return NULL;
+            }
+        }
+    }
+    if (!writing)
+        read_ahead(f);
+    return f;
+}
+
+ssize_t fio_read(struct fio* f, char** block){
+    struct fio_req* r;
+
+    /* the caller is done with the last block, it reads ahead again */
+    f->held = 0;
+    read_ahead(f);
+    if (f->count == 0)
+        return f->err ? (errno = f->err, -1) : 0;
+    r = retire(f);
+    if (r->res < 0){
+        errno = -r->res;
+        return -1;
+    }
+    f->held = 1;
+    *block = r->buf;
+    return r->res;
+}
+
+char* fio_buffer(struct fio* f){
+    if (f->count == f->depth)
+        retire(f);
+    if (f->err){
+        errno = f->err;
+        return NULL;
+    }
+    return f->reqs[(f->head + f->count) % f->depth].buf;
+}
+
+int fio_write(struct fio* f, char* block, size_t len){
+    int slot = (f->head + f->count) % f->depth;
+
+    if (block != f->reqs[slot].buf || len > f->bsize || f->count == f->depth){
+        errno = EINVAL;
+        return -1;
+    }
+    if (f->err){
+        errno = f->err;
+        return -1;
+    }
+    if ((f->flags & FIO_DIRECT) && len % FIO_ALIGN != 0){
+        /* the block stays at its slot, head reaches it once all retired */
+        while (f->count > 0)
+            retire(f);
+        if (set_direct(f->fd, 0) == -1)
+            return -1;
+        f->flags &= ~FIO_DIRECT;
+    }
+    submit(f, slot, len);
+    return 0;
+}
+
+int fio_close(struct fio* f){
+    int err;
+    int i;
+
+    while (f->count > 0)
+        retire(f);
+    if (f->uring)
+        ring_free(&f->ring);
+    else {
+        pthread_mutex_lock(&f->lock);
+        f->stop = 1;
+        pthread_cond_broadcast(&f->cond);
+        pthread_mutex_unlock(&f->lock);
+        for (i = 0; i < f->depth; i++)
+            pthread_join(f->threads[i], NULL);
+        free(f->threads);
+        pthread_cond_destroy(&f->cond);
+        pthread_mutex_destroy(&f->lock);
+    }
+    if (f->flags & FIO_DIRECT)
+        set_direct(f->fd, 0);
+    for (i = 0; i < f->depth; i++)
+        free(f->reqs[i].buf);
+    free(f->reqs);
+    err = f->err;
+    free(f);
+    if (err){
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+const char* fio_backend(struct fio* f){
+    return f->uring ? "io_uring" : "threads";
+}
@@ -0,0 +1,42 @@
+#ifndef GBN_FILEIO_H
+#define GBN_FILEIO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*----- Asynchronous file stage of the sender and the receiver -----*/
+/* a reader keeps depth blocks of the file being read ahead of the caller, */
+/* a writer keeps up to depth blocks being written behind it, so the disk  */
+/* works while the caller is busy with the network                         */
+
+#define FIO_URING   0x01      /* io_uring, with threads when it's missing    */
+#define FIO_THREADS 0x02      /* a pool of threads doing pread/pwrite        */
+#define FIO_DIRECT  0x04      /* the fd is O_DIRECT, blocks are page aligned */
+
+#define FIO_ALIGN   4096      /* alignment of blocks and O_DIRECT I/O        */
+
+struct fio;
+
+/* a reader (writing 0) or writer of fd from its start, with depth blocks */
+/* of blocksize bytes, a multiple of FIO_ALIGN. NULL with errno on failure */
+struct fio* fio_open(int fd, int writing, size_t blocksize, int depth, int flags);
+
+/* reader: the next block of the file in *block, valid until the next */
+/* call. Returns its length, 0 at the end of the file, -1 on errors    */
+ssize_t fio_read(struct fio* f, char** block);
+
+/* writer: a free block to fill, waits for the oldest write if there is */
+/* none. NULL if a write failed */
+char* fio_buffer(struct fio* f);
+
+/* writer: appends len bytes of the block fio_buffer() returned last */
+int fio_write(struct fio* f, char* block, size_t len);
+
+/* waits for all writes and frees the stage, the fd stays open. -1 if */
+/* any I/O failed */
+int fio_close(struct fio* f);
+
+/* "io_uring" or "threads", the backend the stage ended up with */
+const char* fio_backend(struct fio* f);
+
+#endif
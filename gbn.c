@@ -1,73 +1,77 @@
 #include "gbn.h"
 #include "helper.h"
-#include <signal.h>
+#include "checksum.h"
 #include <stdio.h>
 #include <string.h>
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/net_tstamp.h>
 
-state_t s;
-
-/* serialize from header format to buffer format */
-static void serialize_gbnhdr(char* buffer, gbnhdr* hdr, int len){
-    char* ptr;
-    /* idx keeps track of buffer index */
-    int i = 0, idx = 0, num = 0;
-    buffer[idx++] = hdr->type;
-    buffer[idx++] = hdr->seqnum;
 
+/* serialize the header to the first HDRLEN bytes of buffer, */
+/* the payload is sent from where hdr->data points */
+static void serialize_gbnhdr(char* buffer, const gbnhdr* hdr){
     /* not always guaranteed to be using same arch, convert to network byte order */
-    num = htons(hdr->checksum);
-    ptr = (char *)&num;
-    buffer[idx++] = *ptr;
-    buffer[idx++] = *(ptr+1);
-
-    /* copy payload to the buffer */
-    for (; idx < len; i++, idx++){
-        buffer[idx] = hdr->data[i];
-    }
+    uint16_t num = htons(hdr->checksum);
+    uint32_t seq = htonl(hdr->seqnum);
+    buffer[0] = hdr->type;
+    buffer[1] = hdr->flags;
+    memcpy(buffer + 2, &num, sizeof(num));
+    memcpy(buffer + 4, &seq, sizeof(seq));
 }
 
 /* modified checksum previous one was no good, too many collisions */
-uint16_t checksum2(gbnhdr *hdr)
+/* one's complement sum of the header without the checksum field and of */
+/* the payload as big endian 16 bit words, an odd last byte is zero padded */
+/* only the bytes on the wire are summed, see checksum.c for the kernels */
+uint16_t checksum2(const gbnhdr *hdr)
 {
-    int nwords = (sizeof(hdr->type) + sizeof(hdr->seqnum) + sizeof(hdr->data))/sizeof(uint16_t);
-    uint16_t buf_array[nwords];
-    buf_array[0] = (uint16_t)hdr->seqnum + ((uint16_t)hdr->type << 8);
-    int bIndex = 1;
-    for (; bIndex <= sizeof(hdr->data); bIndex++){
-        int wIndex = (bIndex + 1) / 2;
-        if (bIndex % 2 == 1){
-            buf_array[wIndex] = hdr->data[bIndex-1];
-        } else {
-            buf_array[wIndex] = buf_array[wIndex] << 8;
-            buf_array[wIndex] += hdr -> data[bIndex - 1];
-        }
-    }
-    
-    uint16_t *buf = buf_array;
     uint32_t sum;
-    for (sum = 0; nwords > 0; nwords--)
-        sum += *buf++;
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
-    return ~sum;
+    sum = ((uint16_t)hdr->type << 8) + hdr->flags;
+    sum += hdr->seqnum >> 16;
+    sum += hdr->seqnum & 0xffff;
+    return csum_fold(csum_partial(hdr->data, hdr->len, sum));
 }
 
-/* deserialize from buffer format to header format */
-static void deserialize_gbnhdr(char* buffer, gbnhdr* hdr, int data_len){
-    char* ptr;
-    int i = 0, idx = 0;
-    hdr->type = buffer[idx++];
-    hdr->seqnum = buffer[idx++];
+/* CRC32C of the header without the checksum field and of the payload, */
+/* the header only has room for 16 bits so both halves are xor-ed */
+static uint16_t checksum_crc32c(const gbnhdr *hdr)
+{
+    char buffer[HDRLEN];
+    uint32_t crc;
+    serialize_gbnhdr(buffer, hdr);
+    crc = crc32c(0, buffer, 2);
+    crc = crc32c(crc, buffer + 4, 4);
+    crc = crc32c(crc, hdr->data, hdr->len);
+    return (crc >> 16) ^ (crc & 0xffff);
+}
 
-    /* not always guaranteed to be using same arch, convert to host byte order */
-    ptr = (char*)&(hdr->checksum);
-    *ptr = buffer[idx++];
-    *(ptr+1) = buffer[idx++];
-    hdr->checksum = ntohs(hdr->checksum);
-    for (i = 0; i < data_len; i++){
-        hdr->data[i] = buffer[idx++];
+/* checksum of the kind the packet's flags ask for, the handshake is */
+/* always protected by the Internet checksum every peer understands */
+static uint16_t packet_checksum(const gbnhdr *hdr)
+{
+    if ((hdr->flags & GBN_F_CRC32C) && hdr->type != SYN && hdr->type != SYNACK){
+        return checksum_crc32c(hdr);
     }
+    return checksum2(hdr);
+}
+
+/* deserialize the header in place, data points at the payload behind it */
+static void deserialize_gbnhdr(const char* buffer, gbnhdr* hdr, int data_len){
+    uint16_t num;
+    uint32_t seq;
+    hdr->type = buffer[0];
+    hdr->flags = buffer[1];
+
+    /* not always guaranteed to be using same arch, convert to host byte order */
+    memcpy(&num, buffer + 2, sizeof(num));
+    memcpy(&seq, buffer + 4, sizeof(seq));
+    hdr->checksum = ntohs(num);
+    hdr->seqnum = ntohl(seq);
+    hdr->data = (const uint8_t*)buffer + HDRLEN;
+    hdr->len = data_len;
 }
 
 /* original checksum algo */
@@ -88,8 +92,7 @@ uint16_t checksum(uint16_t *buf, int nwords)
 /* test checksum to see if header checksum is correct */
 static int test_checksum(gbnhdr* hdr){
     int ret_checksum = hdr->checksum;
-    hdr->checksum = 0;
-    int cal_checksum = checksum2(hdr);
+    int cal_checksum = packet_checksum(hdr);
     DBG_PRINT("Checksum: Original %d, Calculated %d", ret_checksum, cal_checksum);
     if (ret_checksum != cal_checksum){
         DBG_ERROR("Checksum mismatch! %d, %d", ret_checksum, cal_checksum);
@@ -103,73 +106,560 @@ static void set_checksum(gbnhdr* hdr){
     int ret_checksum;
     /* checksum field is set to 0 when calculating */
     hdr->checksum = 0;
-    ret_checksum = checksum2(hdr);
+    ret_checksum = packet_checksum(hdr);
     hdr->checksum = ret_checksum;
 }
 
-/* ignore alarm signal and re-register handler */
-static void ARLMHNDR(int sig){
-    signal(SIGALRM, SIG_IGN);          /* ignore this signal       */
-    signal(SIGALRM, ARLMHNDR);
+/* handles are fds: the socket's own fd, or a dup() of it per accepted */
+/* connection. The table has two levels so lookups never take a lock */
+#define HANDLE_PAGE 1024
+static state_t** handles[MAXHANDLES / HANDLE_PAGE];
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* map fd to connection c, NULL removes the mapping */
+static int handle_set(int fd, state_t* c){
+    state_t** page;
+    if (fd < 0 || fd >= MAXHANDLES){
+        errno = EMFILE;
+        return -1;
+    }
+    pthread_mutex_lock(&handles_lock);
+    page = handles[fd / HANDLE_PAGE];
+    if (page == NULL){
+        if ((page = calloc(HANDLE_PAGE, sizeof(state_t*))) == NULL){
+            pthread_mutex_unlock(&handles_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        __atomic_store_n(&handles[fd / HANDLE_PAGE], page, __ATOMIC_RELEASE);
+    }
+    page[fd % HANDLE_PAGE] = c;
+    pthread_mutex_unlock(&handles_lock);
+    return 0;
+}
+
+/* connection behind a handle, NULL with EBADF if there is none */
+static state_t* handle_get(int fd){
+    state_t** page;
+    if (fd < 0 || fd >= MAXHANDLES){
+        errno = EBADF;
+        return NULL;
+    }
+    page = __atomic_load_n(&handles[fd / HANDLE_PAGE], __ATOMIC_ACQUIRE);
+    if (page == NULL || page[fd % HANDLE_PAGE] == NULL){
+        errno = EBADF;
+        return NULL;
+    }
+    return page[fd % HANDLE_PAGE];
 }
 
-/* initialize header packets using this function  */
-static void init_header(gbnhdr* hdr, int type, int seq, const char* buf, int len){
-    memset(hdr, 0, sizeof(gbnhdr));
+/* current time of the monotonic clock in microseconds */
+static uint64_t now_usec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* the same clock in nanoseconds, as SO_TXTIME wants it */
+static uint64_t now_nsec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* traces tell connections apart by the peer's port, which sits at the */
+/* same offset in sockaddr_in and sockaddr_in6 */
+static uint32_t conn_port(const state_t* c){
+    return ntohs(((const struct sockaddr_in*)&c->addr)->sin_port);
+}
+
+/* arm the socket's timer for deadline, absolute on the monotonic clock */
+/* (usec), 0 disarms it. Re-arming clears an expiration not read yet */
+static int sock_arm(struct gbn_sock* sk, uint64_t deadline){
+    struct itimerspec its;
+    uint64_t held;
+    sk->due = deadline;
+    /* datagrams the emulator holds go out on the same timer */
+    if (sk->imp != NULL && (held = impair_next(sk->imp)) != 0 && (deadline == 0 || held < deadline)){
+        deadline = held;
+    }
+    /* a zero it_value disarms the timer */
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000000;
+    its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    if (timerfd_settime(sk->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0){
+        DBG_ERROR("Unable to arm timer");
+        return -1;
+    }
+    return 0;
+}
+
+/* send what the emulator held back and is due by now. Blocking calls */
+/* re-arm before they sleep, a non-blocking socket keeps the timer on */
+/* the next held datagram here */
+static void sock_release_held(struct gbn_sock* sk){
+    if (sk->imp != NULL && impair_release(sk->imp) != 0 && sk->nonblock){
+        sock_arm(sk, sk->due);
+    }
+}
+
+/* block until the socket is readable or the deadline passes */
+/* deadline is absolute on the monotonic clock (usec), 0 waits forever */
+/* returns a mask of EV_READ and EV_TIMER, -1 on error */
+static int wait_event(struct gbn_sock* sk, uint64_t deadline){
+    struct epoll_event evs[2];
+    uint64_t expirations;
+    int i, n, ret = 0;
+
+    if (sock_arm(sk, deadline) < 0){
+        return -1;
+    }
+    do {
+        n = epoll_wait(sk->epfd, evs, 2, -1);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0){
+        DBG_ERROR("epoll_wait failed");
+        return -1;
+    }
+    for (i = 0; i < n; i++){
+        if (evs[i].data.fd == sk->tfd){
+            if (read(sk->tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN){
+                DBG_ERROR("Unable to read timer");
+            }
+            ret |= EV_TIMER;
+        }
+        else {
+            ret |= EV_READ;
+        }
+    }
+    sock_release_held(sk);
+    return ret;
+}
+
+/* keep the rto inside the configured bounds */
+static void clamp_rto(state_t* c){
+    if (c->rto < c->rto_min) c->rto = c->rto_min;
+    if (c->rto > c->rto_max) c->rto = c->rto_max;
+}
+
+/* count usec in its power of 2 bucket */
+static void hist_add(uint64_t* hist, uint64_t usec){
+    int i = usec > 1 ? 63 - __builtin_clzll(usec) : 0;
+    hist[i < GBN_HIST ? i : GBN_HIST - 1]++;
+}
+
+/* rto of the smoothed RTT and its variance, without any backoff */
+static void rto_update(state_t* c){
+    uint32_t var;
+    /* a steady RTT leaves no slack for the peer holding its ACK back */
+    var = 4 * c->rttvar > c->srtt / 4 ? 4 * c->rttvar : c->srtt / 4;
+    c->rto = c->srtt + (var > ACK_DELAY ? var : ACK_DELAY);
+    clamp_rto(c);
+}
+
+/* fold one RTT sample (usec) into srtt/rttvar and recompute the rto (RFC 6298) */
+static void rtt_sample(state_t* c, uint64_t rtt){
+    uint32_t err;
+    hist_add(c->stats.rtt_hist, rtt);
+    if (rtt == 0) rtt = 1;
+    if (rtt > c->rto_max) rtt = c->rto_max;
+    if (c->srtt == 0){
+        /* first measurement */
+        c->srtt = rtt;
+        c->rttvar = rtt / 2;
+    }
+    else {
+        /* alpha = 1/8, beta = 1/4 */
+        err = c->srtt > rtt ? c->srtt - rtt : rtt - c->srtt;
+        c->rttvar = c->rttvar - (c->rttvar >> 2) + (err >> 2);
+        c->srtt = c->srtt - (c->srtt >> 3) + (rtt >> 3);
+    }
+    rto_update(c);
+    TRACE(TR_RTT, conn_port(c), rtt, c->srtt, c->rttvar, c->rto);
+}
+
+/* timer expired, double the rto until a fresh sample comes back */
+static void rto_backoff(state_t* c){
+    c->rto = c->rto > c->rto_max / 2 ? c->rto_max : c->rto * 2;
+    clamp_rto(c);
+}
+
+/* fill in a header without its checksum, the payload is not copied */
+static void fill_header(gbnhdr* hdr, int type, uint32_t seq, const char* buf, int len, int flags){
     hdr->type = type;
+    hdr->flags = flags;
     hdr->seqnum = seq;
-    hdr->checksum = 0;
+    /* control packets are only a header on the wire */
     if (buf == NULL){
-        memset(hdr->data, 0, DATALEN);
+        hdr->data = NULL;
+        hdr->len = 0;
     }
     else{
-        memcpy(hdr->data, buf, len);
+        hdr->data = (const uint8_t*)buf;
+        hdr->len = len;
     }
+}
+
+/* initialize header packets using this function */
+static void init_header(gbnhdr* hdr, int type, uint32_t seq, const char* buf, int len, int flags){
+    fill_header(hdr, type, seq, buf, len, flags);
     set_checksum(hdr);
 }
 
-/* sends header over to the server using the original sendto() function */
-static int sendto_hdr(int sockfd, gbnhdr* hdr, int hdr_len){
+/* point msg at the header and the payload of hdr */
+static void init_msg(struct msghdr* msg, struct iovec* iov, char* buffer, const gbnhdr* hdr){
+    serialize_gbnhdr(buffer, hdr);
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = HDRLEN;
+    iov[1].iov_base = (void*)hdr->data;
+    iov[1].iov_len = hdr->len;
+    msg->msg_iov = iov;
+    msg->msg_iovlen = hdr->len > 0 ? 2 : 1;
+}
+
+/* sends header over to the peer using the original sendto() function */
+static int sendto_hdr(state_t* c, gbnhdr* hdr){
     int count = 0;
-    char buffer[hdr_len];
-    memset(buffer, 0, hdr_len);
-    serialize_gbnhdr(buffer, hdr, hdr_len);
-    if ((count = sendto(sockfd, buffer, hdr_len, 0, &s.addr, s.len)) != hdr_len){
-        DBG_ERROR("Size of sent %d is different than expected %d.", count, hdr_len);
+    char buffer[HDRLEN];
+    struct iovec iov[2];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &c->addr;
+    msg.msg_namelen = c->len;
+    init_msg(&msg, iov, buffer, hdr);
+    if ((count = sendmsg(c->sock->fd, &msg, 0)) != HDRLEN + hdr->len){
+        DBG_ERROR("Size of sent %d is different than expected %d.", count, HDRLEN + hdr->len);
         return -1;
     }
     return count;
 }
 
-/* sends header over to the server using the fake sendto() function for packet losses*/
-static int sendto_maybe_hdr(int sockfd, gbnhdr* hdr, int hdr_len){
-    int count = 0;
-    char buffer[hdr_len];
-    memset(buffer, 0, hdr_len);
-    serialize_gbnhdr(buffer, hdr, hdr_len);
-    if ((count = maybe_sendto(sockfd, buffer, hdr_len, 0, &s.addr, s.len)) != hdr_len){
-        DBG_ERROR("Size of sent %d is different than expected %d.", count, hdr_len);
+/* sends header over to the peer through the socket's emulated network */
+static int sendto_maybe_hdr(state_t* c, gbnhdr* hdr){
+    char buffer[HDRLEN];
+    char scratch[HDRLEN + DATALEN];
+    struct iovec iov[2];
+    struct mmsghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_hdr.msg_name = &c->addr;
+    msg.msg_hdr.msg_namelen = c->len;
+    init_msg(&msg.msg_hdr, iov, buffer, hdr);
+    if ((c->sock->imp == NULL || impair_msgs(c->sock->imp, c->sock->fd, &msg, 1, scratch, sizeof(scratch)) == 1) &&
+        sendmsg(c->sock->fd, &msg.msg_hdr, 0) != HDRLEN + hdr->len){
+        DBG_ERROR("Size of sent packet is different than expected %d.", HDRLEN + hdr->len);
         return -1;
     }
+    sock_release_held(c->sock);
+    return HDRLEN + hdr->len;
+}
+
+/* check length and checksum of a received packet and parse its header, */
+/* hdr->data points into buffer */
+static int parse_hdr(const char* buffer, int count, gbnhdr* hdr){
+    /* a packet shorter than the header can only be garbage */
+    if (count < HDRLEN || count > HDRLEN + MAXDATALEN){
+        DBG_ERROR("Size of received packet %d is not a valid packet size.", count);
+        return -4;
+    }
+    deserialize_gbnhdr(buffer, hdr, count - HDRLEN);
+    if (test_checksum(hdr) != 0){
+        return -4;
+    }
     return count;
 }
 
-/* receives header using the recfrom() function */
-static int recvfrom_hdr(int sockfd, gbnhdr* hdr, int type, int seq,
-                        struct sockaddr* addr, socklen_t* len, int timed){
+/* allocate a batch of cap slots of bufsize bytes, every message pointing */
+/* at its own slot and address */
+static struct gbn_batch* batch_new(size_t bufsize, int cap){
+    int i;
+    struct gbn_batch* b = calloc(1, sizeof(struct gbn_batch));
+    if (b == NULL){
+        return NULL;
+    }
+    if ((b->bufs[0] = malloc(bufsize * cap)) == NULL){
+        free(b);
+        return NULL;
+    }
+    b->bufsize = bufsize;
+    b->cap = cap;
+    for (i = 0; i < cap; i++){
+        b->bufs[i] = b->bufs[0] + bufsize * i;
+        b->iovs[i][0].iov_base = b->bufs[i];
+        b->iovs[i][0].iov_len = bufsize;
+        b->msgs[i].msg_hdr.msg_iov = b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+    }
+    return b;
+}
+
+static void batch_free(struct gbn_batch* b){
+    if (b != NULL){
+        free(b->bufs[0]);
+        free(b);
+    }
+}
+
+/* sendmmsg() until every message is out */
+static int sendmmsg_all(int fd, struct mmsghdr* msgs, unsigned int vlen){
+    unsigned int total = 0;
+    int sent;
+    while (total < vlen){
+        if ((sent = sendmmsg(fd, msgs + total, vlen - total, 0)) < 0){
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += sent;
+    }
+    return total;
+}
+
+/* bytes in a message */
+static size_t msg_size(const struct msghdr* mh){
+    size_t i, len = 0;
+    for (i = 0; i < mh->msg_iovlen; i++){
+        len += mh->msg_iov[i].iov_len;
+    }
+    return len;
+}
+
+/* writes a control message at buf, returns the room it takes */
+static size_t put_cmsg(char* buf, int level, int type, const void* data, size_t len){
+    struct cmsghdr* cm = (struct cmsghdr*)buf;
+    cm->cmsg_level = level;
+    cm->cmsg_type = type;
+    cm->cmsg_len = CMSG_LEN(len);
+    memcpy(CMSG_DATA(cm), data, len);
+    return CMSG_SPACE(len);
+}
+
+/* SO_TXTIME departure of a queued message, 0 if it has none */
+static uint64_t msg_txtime(struct msghdr* mh){
+    uint64_t when = 0;
+    if (mh->msg_controllen != 0){
+        memcpy(&when, CMSG_DATA(CMSG_FIRSTHDR(mh)), sizeof(when));
+    }
+    return when;
+}
+
+/* coalesce runs of packets to the same peer into one UDP_SEGMENT send */
+/* each, chaining their iovecs. All packets of a run have the size of the */
+/* first one, except the last which may be shorter */
+static int gso_send(struct gbn_sock* sk, unsigned int kept){
+    struct gbn_batch* b = sk->tx;
+    unsigned int i = 0, j, k, m = 0, total = 0, v = 0;
+    unsigned int first[BATCH];
+    int sent;
+    while (i < kept){
+        struct msghdr* mh = &b->msgs[i].msg_hdr;
+        size_t seg = msg_size(mh);
+        size_t prev = seg;
+        uint64_t when = msg_txtime(mh);
+        unsigned int maxsegs = 65507 / seg < GSOSEGS ? 65507 / seg : GSOSEGS;
+        for (j = i + 1; j < kept && j - i < maxsegs; j++){
+            size_t cur = msg_size(&b->msgs[j].msg_hdr);
+            if (prev != seg || cur > seg || msg_txtime(&b->msgs[j].msg_hdr) != when ||
+                b->msgs[j].msg_hdr.msg_namelen != mh->msg_namelen ||
+                memcmp(b->msgs[j].msg_hdr.msg_name, mh->msg_name, mh->msg_namelen) != 0){
+                break;
+            }
+            prev = cur;
+        }
+        b->gso_msgs[m].msg_hdr = *mh;
+        if (j - i > 1){
+            uint16_t segsize = seg;
+            size_t clen;
+            b->gso_msgs[m].msg_hdr.msg_iov = &b->gso_iovs[v];
+            for (; i < j; i++){
+                for (k = 0; k < b->msgs[i].msg_hdr.msg_iovlen; k++){
+                    b->gso_iovs[v++] = b->msgs[i].msg_hdr.msg_iov[k];
+                }
+            }
+            b->gso_msgs[m].msg_hdr.msg_iovlen = &b->gso_iovs[v] - b->gso_msgs[m].msg_hdr.msg_iov;
+            /* a paced run keeps the departure time of its packets */
+            clen = put_cmsg(b->gso_ctrl[m], SOL_UDP, UDP_SEGMENT, &segsize, sizeof(segsize));
+            if (when != 0){
+                clen += put_cmsg(b->gso_ctrl[m] + clen, SOL_SOCKET, SCM_TXTIME, &when, sizeof(when));
+            }
+            b->gso_msgs[m].msg_hdr.msg_control = b->gso_ctrl[m];
+            b->gso_msgs[m].msg_hdr.msg_controllen = clen;
+        }
+        first[m++] = i;
+        i = j;
+    }
+    while (total < m){
+        if ((sent = sendmmsg(sk->fd, b->gso_msgs + total, m - total, 0)) < 0){
+            if (errno == EINTR)
+                continue;
+            if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP){
+                /* the device can't segment, fall back to plain datagrams */
+                DBG_ERROR("UDP GSO rejected, disabling it");
+                sk->gso = 0;
+                return sendmmsg_all(sk->fd, b->msgs + first[total], kept - first[total]);
+            }
+            return -1;
+        }
+        total += sent;
+    }
+    return kept;
+}
+
+/* hand the queued datagrams to the kernel, through the emulated network */
+static int batch_flush(struct gbn_sock* sk){
+    struct gbn_batch* b = sk->tx;
+    unsigned int kept;
+    int i, ret = 0;
+    if (b->n == 0){
+        return 0;
+    }
+    for (i = 0; i < b->n; i++){
+        if (b->when[i] != 0){
+            b->msgs[i].msg_hdr.msg_control = b->ctrl[i];
+            b->msgs[i].msg_hdr.msg_controllen =
+                put_cmsg(b->ctrl[i], SOL_SOCKET, SCM_TXTIME, &b->when[i], sizeof(b->when[i]));
+        }
+    }
+    kept = sk->imp != NULL ? impair_msgs(sk->imp, sk->fd, b->msgs, b->n, b->bufs[0], b->bufsize) : b->n;
+    if ((sk->gso ? gso_send(sk, kept) : sendmmsg_all(sk->fd, b->msgs, kept)) < 0){
+        DBG_ERROR("Error occured while sending a batch of %d packets", b->n);
+        ret = -1;
+    }
+    /* duplicates are held for right after the batch */
+    sock_release_held(sk);
+    /* dropping packets shuffles the messages, point them back at their slots */
+    for (i = 0; i < b->n; i++){
+        b->msgs[i].msg_hdr.msg_iov = b->iovs[i];
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+        b->msgs[i].msg_hdr.msg_control = NULL;
+        b->msgs[i].msg_hdr.msg_controllen = 0;
+    }
+    b->n = 0;
+    return ret;
+}
+
+/* room for a small payload that has to outlive the caller until the */
+/* batch is flushed, valid for the next batch_add() */
+static uint8_t* batch_payload(struct gbn_sock* sk){
+    struct gbn_batch* b = sk->tx;
+    if (b->n == b->cap){
+        batch_flush(sk);
+    }
+    /* behind the room impair_msgs() needs for the header */
+    return (uint8_t*)b->bufs[b->n] + HDRLEN;
+}
+
+/* grow the slots of the socket's batches to datagrams with a payload of */
+/* datalen, GRO slots are big enough already */
+static int sock_resize(struct gbn_sock* sk, uint32_t datalen){
+    struct gbn_batch* tx;
+    struct gbn_batch* rx = NULL;
+    if (datalen <= sk->maxdata){
+        return 0;
+    }
+    batch_flush(sk);
+    tx = batch_new(HDRLEN + datalen, BATCH);
+    if (!sk->gro){
+        rx = batch_new(HDRLEN + datalen, BATCH);
+    }
+    if (tx == NULL || (!sk->gro && rx == NULL)){
+        batch_free(tx);
+        batch_free(rx);
+        return -1;
+    }
+    batch_free(sk->tx);
+    sk->tx = tx;
+    if (rx != NULL){
+        batch_free(sk->rx);
+        sk->rx = rx;
+    }
+    sk->maxdata = datalen;
+    return 0;
+}
+
+/* queue a packet for connection c, flushing first if the batch is full */
+/* the payload is not copied and must stay put until the batch is flushed */
+static void batch_add(state_t* c, gbnhdr* hdr){
+    struct gbn_batch* b = c->sock->tx;
+    if (b->n == b->cap){
+        batch_flush(c->sock);
+    }
+    init_msg(&b->msgs[b->n].msg_hdr, b->iovs[b->n], b->hdrs[b->n], hdr);
+    memcpy(&b->addrs[b->n], &c->addr, c->len);
+    b->msgs[b->n].msg_hdr.msg_namelen = c->len;
+    b->when[b->n] = 0;
+    b->n++;
+}
+
+/* drain up to BATCH queued datagrams into sk->rx with one recvmmsg, */
+/* sleeping until the first one arrives or the deadline (0 = never) passes */
+/* returns the number of datagrams, -1 on timeout or error */
+static int recv_batch(struct gbn_sock* sk, uint64_t deadline){
+    struct gbn_batch* b = sk->rx;
+    int i, n;
+    for (;;){
+        for (i = 0; i < b->cap; i++){
+            b->iovs[i][0].iov_len = b->bufsize;
+            b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+            /* GRO tells the size of the segments it glued together */
+            b->msgs[i].msg_hdr.msg_control = sk->gro ? b->ctrl[i] : NULL;
+            b->msgs[i].msg_hdr.msg_controllen = sk->gro ? sizeof(b->ctrl[i]) : 0;
+        }
+        n = recvmmsg(sk->fd, b->msgs, b->cap, MSG_DONTWAIT, NULL);
+        if (n > 0){
+            b->n = n;
+            return n;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            DBG_ERROR("recvmmsg failed");
+            return -1;
+        }
+        /* nothing queued, sleep until a packet arrives or time runs out */
+        if ((deadline != 0 && now_usec() >= deadline) || wait_event(sk, deadline) < 0){
+            return -1;
+        }
+    }
+}
+
+/* size of the packets in received datagram i, GRO may have glued several */
+/* together and then all but the last one have this size */
+static int rx_segsize(struct gbn_batch* b, int i){
+    struct msghdr* mh = &b->msgs[i].msg_hdr;
+    struct cmsghdr* cm;
+    int seg;
+    for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)){
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO){
+            memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+            if (seg > 0){
+                return seg;
+            }
+        }
+    }
+    return b->msgs[i].msg_len;
+}
+
+/* receives header on a client socket using the recfrom() function */
+/* gives up with -1 once the deadline (usec, monotonic) passes, 0 waits forever */
+/* the packet is received into buffer, hdr->data points at its payload */
+static int recvfrom_hdr(state_t* c, gbnhdr* hdr, int type, uint32_t seq, uint64_t deadline,
+                        char* buffer, size_t size){
     int count = 0;
-    char buffer[sizeof(gbnhdr)];
     memset(hdr, 0, sizeof(gbnhdr));
-    /* if the given addr is NULL don't receive a struct */
-    if (addr == NULL){
-        count = recvfrom(sockfd, buffer, sizeof(gbnhdr), 0, NULL, NULL);
-    }
-    else{
-        count = recvfrom(sockfd, buffer, sizeof(gbnhdr), 0, addr, len);
+    for (;;){
+        count = recvfrom(c->sock->fd, buffer, size, MSG_DONTWAIT, NULL, NULL);
+        if (count >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+            break;
+        }
+        /* nothing queued, sleep until a packet arrives or time runs out */
+        if ((deadline != 0 && now_usec() >= deadline) || wait_event(c->sock, deadline) < 0){
+            count = -1;
+            break;
+        }
     }
 
     if (count < 1){
-        /* alarm clock was fired */
+        /* deadline passed or socket error */
         if (count == -1){
             DBG_ERROR("Operation timed out.");
             return -1;
@@ -179,10 +669,9 @@ static int recvfrom_hdr(int sockfd, gbnhdr* hdr, int type, int seq,
             return 0;
         }
     }
-    /* deserialize and check checksum first, type second and sequence third */
+    /* check checksum first, type second and sequence third */
     /* different return codes will signify different failure symptoms for callee */
-    deserialize_gbnhdr(buffer, hdr, count - 4);
-    if (test_checksum(hdr) != 0){
+    if (parse_hdr(buffer, count, hdr) < 0){
         return -4;
     }
     if (hdr->type != type){
@@ -196,287 +685,1752 @@ static int recvfrom_hdr(int sockfd, gbnhdr* hdr, int type, int seq,
     return count;
 }
 
-/* use packet to represent one 1024 bytes of data */
-struct packet {
-    char* start_addr;
-    int length;
-};
+/* SYN and SYNACK carry the largest payload their sender takes, SYNOPTLEN */
+/* bytes in network order kept in opt until the packet is sent */
+static void init_syn(gbnhdr* hdr, int type, state_t* c, uint8_t* opt){
+    uint16_t payload = htons(c->payload);
+    memcpy(opt, &payload, sizeof(payload));
+    init_header(hdr, type, 0, (const char*)opt, SYNOPTLEN, c->flags);
+}
 
-ssize_t gbn_send(int sockfd, const void *buf, size_t len, int flags){
+/* payload offered by a SYN or SYNACK, DATALEN if the peer offers none */
+static uint32_t syn_payload(const gbnhdr* hdr){
+    uint16_t payload;
+    if (hdr->len < SYNOPTLEN){
+        return DATALEN;
+    }
+    memcpy(&payload, hdr->data, sizeof(payload));
+    payload = ntohs(payload);
+    return payload < MINDATALEN ? MINDATALEN : payload;
+}
 
-    if (s.state != ESTABLISHED){
-        DBG_ERROR("ESTABLISHED state");
-        return -1;
+/* lower the payload so that DATA packets fit the path MTU the kernel knows */
+/* for the server. Only a connected UDP socket reports it, a client socket */
+/* talks to nobody else anyway */
+static void pmtu_clamp(state_t* c){
+    int mtu, iphdr;
+    socklen_t len = sizeof(mtu);
+    if (connect(c->sock->fd, (struct sockaddr*)&c->addr, c->len) < 0){
+        DBG_ERROR("Unable to connect the socket, path MTU unknown");
+        return;
+    }
+    if (c->addr.ss_family == AF_INET6){
+        iphdr = 40;
+        mtu = getsockopt(c->sock->fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len) < 0 ? -1 : mtu;
+    }
+    else {
+        iphdr = 20;
+        mtu = getsockopt(c->sock->fd, IPPROTO_IP, IP_MTU, &mtu, &len) < 0 ? -1 : mtu;
+    }
+    if (mtu < 0){
+        DBG_ERROR("Path MTU unknown");
+        return;
     }
+    mtu -= iphdr + 8 + HDRLEN;
+    if (mtu >= MINDATALEN && mtu < (int)c->payload){
+        c->payload = mtu;
+    }
+}
 
-    char* buffer = (char*)buf;
-    /* split input buffer into a an array of packets */
-    int i = 0;
-    int send_len = 0;
-    int read_len = len;
-    uint32_t array_len = len % DATALEN == 0? len/DATALEN : len/DATALEN + 1;
-    /*DBG_PRINT("Array Length %d", array_len);*/
-    struct packet* packs = malloc(sizeof(struct packet) * array_len);
-    for (; i < array_len; i++, buffer += DATALEN, read_len -= DATALEN){
-        send_len = read_len < DATALEN ? read_len : DATALEN;
-        packs[i].start_addr = buffer;
-        packs[i].length = send_len;
+/* new connection on socket sk, options are copied from tmpl when given */
+static state_t* conn_new(struct gbn_sock* sk, const state_t* tmpl){
+    state_t* c;
+    if ((c = calloc(1, sizeof(state_t))) == NULL){
+        DBG_ERROR("Unable to allocate connection");
+        return NULL;
     }
+    c->state = CLOSED;
+    c->payload = tmpl != NULL ? tmpl->payload : DATALEN;
+    c->winsize = tmpl != NULL ? tmpl->winsize : WINSIZE;
+    c->rto_min = tmpl != NULL ? tmpl->rto_min : RTO_MIN;
+    c->rto_max = tmpl != NULL ? tmpl->rto_max : RTO_MAX;
+    c->rcap = tmpl != NULL ? tmpl->rcap : RCVBUF;
+    c->sndbuf = tmpl != NULL ? tmpl->sndbuf : SNDBUF;
+    c->ack_every = tmpl != NULL ? tmpl->ack_every : ACK_EVERY;
+    c->ack_delay = tmpl != NULL ? tmpl->ack_delay : ACK_DELAY;
+    c->dup_thresh = tmpl != NULL ? tmpl->dup_thresh : DUP_THRESH;
+    c->cc.ops = tmpl != NULL ? tmpl->cc.ops : cc_find(GBN_CC_CUBIC);
+    c->pacing = tmpl != NULL ? tmpl->pacing : GBN_PACE_USER;
+    c->pace_rate = tmpl != NULL ? tmpl->pace_rate : 0;
+    c->fec_k = tmpl != NULL ? tmpl->fec_k : 0;
+    c->fec_auto = tmpl != NULL ? tmpl->fec_auto : 0;
+    c->cc.ops->init(&c->cc);
+    c->rto = RTO_INIT;
+    c->sock = sk;
+    return c;
+}
 
-    /*start sending it using window size 1 */
-    int res = 0;
-    /* on successful sends reset attempts to 0, else on fails increment attempts */
-    int attempts = 0;
-    int packs_sent = 0;
-    s.winsize = 1;
-    gbnhdr hdr = {0};
-    /* have a sliding window keeping track of index along with cursor */
-    uint8_t window[2] = {0, 1};
-    uint8_t seq_cur = s.ex_seqnum;
-    /* set window slots */
-    window[0] = s.ex_seqnum;
-
-    /* setup timer */
-    signal(SIGALRM, ARLMHNDR);
-    struct itimerval timer;
-    timer.it_value.tv_sec = 0;
-    timer.it_value.tv_usec = 250000;
-    timer.it_interval.tv_sec = 0;
-    timer.it_interval.tv_usec = 0;
+/* unmap the parts of files whose packets are all ACK'd, all of them */
+/* once the connection goes away */
+static void maps_release(state_t* c, int all){
+    struct gbn_map* m;
+    while ((m = c->maps) != NULL && (all || SEQ_LT(m->last, c->snd_base))){
+        munmap(m->addr, m->len);
+        c->maps = m->next;
+        free(m);
+    }
+    if (c->maps == NULL){
+        c->maps_tail = NULL;
+    }
+}
 
-    do {
-        /* send the packets dpending on the window size */
-        int i;
-        int ack_exp = 0;
-        for (i = 0; i < s.winsize; i++){
-            if (seq_cur == window[i]) {
-                init_header(&hdr, DATA, seq_cur, packs[seq_cur].start_addr, packs[seq_cur].length);
-                if (sendto_maybe_hdr(sockfd, &hdr, packs[seq_cur].length + 4) < 1) {
-                    DBG_ERROR("Error occured while sending");
-                    seq_cur--;
-                    continue;
-                }
-                seq_cur++;
-                ack_exp++;
-            }
-        }
-
-        /* for receiving packets, make sure that the packets are within bounds of window */
-        for (i = 0; i < ack_exp; i++){
-            setitimer(ITIMER_REAL, &timer, NULL);
-            res = recvfrom_hdr(sockfd, &hdr, DATAACK, window[0], NULL, NULL, 0);
-            /* split between windows size cases */
-            if (s.winsize == 1){
-                if (res > 0){ /* packets received are correct */
-                    window[0]++;
-                    packs_sent++;
-                    s.winsize = 2;
-                    attempts = 0;
-                }
-                else{   /* packets received are not correct, reset cursor */
-                    seq_cur = window[0];
-                    s.winsize = 1;
-                    attempts++;
-                }
-            }else{ /* window size 2 */
-                if (res > 0){   /* packets received are correct */
-                    window[0]++;
-                    packs_sent++;
-                    s.winsize = 2;
-                    attempts = 0;
-                }
-                else if(res == -3 && hdr.seqnum == window[1]){
-                    /* packets received came in out of order but within bounds */
-                    /* use cumulative ACK */
-                    packs_sent += 2;
-                    window[0] = window[1] + 1;
-                    s.winsize = 2;
-                    attempts = 0;
-                    break;
-                }
-                else{
-                    /* something failed reset cursor to first un-ACK'd packet */
-                    seq_cur = window[0];
-                    s.winsize = 1;
-                    attempts++;
-                }
-            }
-        }
-        DBG_PRINT("DATAACK: packet %d, res %d", hdr.seqnum, res);
-        /* make sure the window indices don't go past array size */
-        window[0] = window[0] >= array_len - 1 ? array_len - 1 : window[0];
-        window[1] = window[0] >= array_len - 1 ? array_len - 1: window[0] + s.winsize - 1;
-    } while(packs_sent != array_len && attempts != 10);
-    DBG_PRINT("Exiting out of gbn_send");
-    return 0;
+static void conn_free(state_t* c){
+    maps_release(c, 1);
+    free(c->ring);
+    free(c->sbuf);
+    free(c->rbuf);
+    free(c->held);
+    free(c->fec_parity);
+    free(c->fec_held);
+    free(c);
 }
 
-/* the receiver essentially acts like it has window size 1 */
-/* if any packet received out of order, reject and request last ACKed packet */
-ssize_t gbn_recv(int sockfd, void *buf, size_t len, int flags){
-    int count  = 0;
-    gbnhdr hdr = {0};
-    int cflag = 0;
-    do
-    {
-        switch(s.state){
-            case ESTABLISHED:
-                count = recvfrom_hdr(sockfd, &hdr, DATA, s.ex_seqnum, NULL, NULL, 0);
-                DBG_PRINT("Got packet length %d, seq %d from socket", count, hdr.seqnum);
-                /* the type is wrong */
-                if (count == -2) {
-                    if (hdr.type == SYN) {
-                        /* client is still waiting for SYNACK */
-                        init_header(&hdr, SYNACK, 0, NULL, 0);
-                    } else if (hdr.type == FIN) {
-                        /* client sent FIN, have gbn_close deal with it */
-                        s.state = FIN_RCVD;
-                        return 0;
-                    } else {
-                        /* something is horribly wrong */
-                        return -1;
-                    }
-                }
-                else if (count < 0){
-                    if (count == -3 && hdr.seqnum < s.ex_seqnum){ /* lower packet sequence arrived ACK number back */
-                        init_header(&hdr, DATAACK, hdr.seqnum, NULL, 0);
-                    }
-                    else { /* something else went wrong, ack with last sequence (packet larger than sequence) */
-                        init_header(&hdr, DATAACK, s.ex_seqnum - 1, NULL, 0);
-                    }
-                }
-                else { /* we got the right packet */
-                    /* we got the right packet, write to file */
-                    memcpy(buf, hdr.data, count - 4);
-                    init_header(&hdr, DATAACK, s.ex_seqnum, NULL, 0);
-                    DBG_PRINT("Writing packet %d to file", hdr.seqnum);
-                    s.ex_seqnum++;
-                    cflag = 1;
-                }
-                if (sendto_maybe_hdr(sockfd, &hdr, sizeof(gbnhdr)) < 1){
-                    /* critical error occured, bail */
-                    DBG_ERROR("Can't send to client.");
-                    return -1;
-                }
-                DBG_PRINT("Sending packet %d", hdr.seqnum);
-                break;
-            default:
-                return -1;
-        }
-    }while(!cflag);
-    DBG_PRINT("gbn_recv EXITING");
-    /* -4 for the type, seqnum, check bytes */
-    return count - 4;
+/* hash of the peer address, only family, port and IP take part (FNV-1a) */
+static uint32_t addr_hash(const struct sockaddr_storage* addr){
+    const uint8_t* key = NULL;
+    const uint8_t* port = NULL;
+    int i, klen = 0;
+    uint32_t h = 2166136261u;
+    if (addr->ss_family == AF_INET){
+        const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+        key = (const uint8_t*)&in->sin_addr;
+        klen = sizeof(in->sin_addr);
+        port = (const uint8_t*)&in->sin_port;
+    }
+    else if (addr->ss_family == AF_INET6){
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+        key = (const uint8_t*)&in6->sin6_addr;
+        klen = sizeof(in6->sin6_addr);
+        port = (const uint8_t*)&in6->sin6_port;
+    }
+    for (i = 0; i < klen; i++){
+        h = (h ^ key[i]) * 16777619u;
+    }
+    if (port != NULL){
+        h = (h ^ port[0]) * 16777619u;
+        h = (h ^ port[1]) * 16777619u;
+    }
+    return h;
 }
 
-/* Send FIN, Recv FIN, Send FINACK, Recv FINACK */
-/* implemented with two way hand shake */
-int gbn_close(int sockfd){
-    int count = 0;
-    int attempt = 0;
-    gbnhdr hdr = {0};
-    /* setup timer scaffolding */
-    signal(SIGALRM, ARLMHNDR);
-    struct itimerval timer;
-    timer.it_value.tv_sec = 0;
-    timer.it_value.tv_usec = 250000;
-    timer.it_interval.tv_sec = 0;
-    timer.it_interval.tv_usec = 0;
-    while (s.state != CLOSED){
-        if (attempt == 10) break;
-        switch(s.state){
-            case ESTABLISHED:   /* this must be client, send first FIN */
-                init_header(&hdr, FIN, 0, NULL, 0);
-                if ((count = sendto_maybe_hdr(sockfd, &hdr, sizeof(gbnhdr))) < 1){
-                    DBG_ERROR("Error occured while sending");
-                    attempt++;
-                    continue;
-                }
-                s.state = FIN_SENT;
-                break;
-            case FIN_SENT:      /* client waits for FINACK to respond */
-                setitimer(ITIMER_REAL, &timer, NULL);
-                if ((count = recvfrom_hdr(sockfd, &hdr, FINACK, 0, NULL, NULL, 0)) < 1){
-                    DBG_ERROR("Error occured while waiting for recvfrom");
-                    s.state = ESTABLISHED;
-                    attempt++;
-                    continue;
-                }
-                s.state = CLOSED;
-                break;
-            case FIN_RCVD: /* server comes here to send FINACK to client */
-                init_header(&hdr, FINACK, 0, NULL, 0);
-                if ((count = sendto_maybe_hdr(sockfd, &hdr, sizeof(gbnhdr))) < 1){
-                    DBG_ERROR("Error occured while sending");
-                    attempt++;
-                    continue;
-                }
-                s.state = CLOSED;
-                break;
-            case CLOSED:
-                break;
-        }
+static int addr_equal(const struct sockaddr_storage* a, const struct sockaddr_storage* b){
+    if (a->ss_family != b->ss_family){
+        return 0;
     }
-    if (attempt == 10){     /* max amount of attempts reached, hang up */
-        DBG_ERROR("Attempts limit reached. State: %d.", s.state);
-        return -2;
+    if (a->ss_family == AF_INET){
+        const struct sockaddr_in* x = (const struct sockaddr_in*)a;
+        const struct sockaddr_in* y = (const struct sockaddr_in*)b;
+        return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    if (a->ss_family == AF_INET6){
+        const struct sockaddr_in6* x = (const struct sockaddr_in6*)a;
+        const struct sockaddr_in6* y = (const struct sockaddr_in6*)b;
+        return x->sin6_port == y->sin6_port &&
+               memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
     }
     return 0;
 }
 
-/* SYN, SYNACK packets will only compose of type and checksum field, no seqnum and data */
-int gbn_connect(int sockfd, const struct sockaddr *server, socklen_t socklen){
-    int count;
-    int attempts = 0;
-    gbnhdr hdr = {0};
-    /* save server address */
-    memcpy(&s.addr, server, socklen);
-    s.len = socklen;
-    signal(SIGALRM, ARLMHNDR);
+/* find the connection of a peer on a listening socket */
+static state_t* conn_lookup(struct gbn_sock* sk, const struct sockaddr_storage* addr){
+    state_t* c = sk->table[addr_hash(addr) & sk->table_mask];
+    while (c != NULL && !addr_equal(&c->addr, addr)){
+        c = c->hnext;
+    }
+    return c;
+}
 
-    /* FSM starts here, try 10 times */
-    while (s.state != ESTABLISHED) {
-        if (attempts == 10) break;
-        switch (s.state){
-            case CLOSED:
-                /* setup SYN packet */
-                /* use a full buffer for syn packets*/
-                init_header(&hdr, SYN, 0, NULL, 0);
-                DBG_PRINT("Checksum: %d", hdr.checksum);
-                if (sendto_maybe_hdr(sockfd, &hdr, sizeof(gbnhdr)) < 1){
-                    DBG_ERROR("An error occured sending SYN");
-                    attempts++;
-                    continue;
-                }
-                DBG_PRINT("SYN_SENT Checkpoint");
-                /* update state variables */
-                s.state = SYN_SENT;
-                break;
-            case SYN_SENT:
-                alarm(TIMEOUT);
-                if ((count = recvfrom_hdr(sockfd, &hdr, SYNACK, 0, NULL, NULL, 1)) < 1){
-                    DBG_ERROR("Did not receive FINACK");
-                    attempts++;
-                    /* reset set to CLOSED and resend */
-                    s.state = CLOSED;
-                    continue;
-                }
-                DBG_PRINT("ESTABLISHED Checkpoint");
-                s.state = ESTABLISHED;
-                s.ex_seqnum = 0;
-                break;
-            case ESTABLISHED:
-                break;
+/* add a connection to the table, doubling the buckets when it gets full */
+static int conn_insert(struct gbn_sock* sk, state_t* c){
+    uint32_t i, h;
+    if (sk->nconns > sk->table_mask){
+        uint32_t mask = sk->table_mask * 2 + 1;
+        state_t** table = calloc(mask + 1, sizeof(state_t*));
+        if (table == NULL){
+            DBG_ERROR("Unable to grow the connection table");
+            return -1;
         }
+        for (i = 0; i <= sk->table_mask; i++){
+            while (sk->table[i] != NULL){
+                state_t* e = sk->table[i];
+                sk->table[i] = e->hnext;
+                h = addr_hash(&e->addr) & mask;
+                e->hnext = table[h];
+                table[h] = e;
+            }
+        }
+        free(sk->table);
+        sk->table = table;
+        sk->table_mask = mask;
     }
-    if (attempts == 10) {
-        DBG_ERROR("Server hung up first!");
-        return -2;
-    }
+    h = addr_hash(&c->addr) & sk->table_mask;
+    c->hnext = sk->table[h];
+    sk->table[h] = c;
+    sk->nconns++;
     return 0;
 }
 
+static void conn_remove(struct gbn_sock* sk, state_t* c){
+    state_t** pp = &sk->table[addr_hash(&c->addr) & sk->table_mask];
+    while (*pp != NULL && *pp != c){
+        pp = &(*pp)->hnext;
+    }
+    if (*pp == c){
+        *pp = c->hnext;
+        sk->nconns--;
+    }
+}
+
+/* drop one handle reference, the last one tears the socket down */
+static void sock_release(struct gbn_sock* sk){
+    uint32_t i;
+    int refs;
+    pthread_mutex_lock(&sk->lock);
+    refs = --sk->refs;
+    pthread_mutex_unlock(&sk->lock);
+    if (refs > 0){
+        return;
+    }
+    /* only connections that were never accepted are left in the table */
+    if (sk->table != NULL){
+        for (i = 0; i <= sk->table_mask; i++){
+            while (sk->table[i] != NULL){
+                state_t* e = sk->table[i];
+                sk->table[i] = e->hnext;
+                conn_free(e);
+            }
+        }
+        free(sk->table);
+    }
+    conn_free(sk->conn);
+    impair_drain(sk->imp);
+    impair_free(sk->imp);
+    batch_free(sk->tx);
+    batch_free(sk->rx);
+    close(sk->tfd);
+    close(sk->epfd);
+    close(sk->fd);
+    pthread_mutex_destroy(&sk->lock);
+    pthread_cond_destroy(&sk->cond);
+    free(sk);
+}
+
+/* append in-order payload to the receive buffer, -1 if it doesn't fit */
+static int rbuf_append(state_t* c, const uint8_t* data, size_t len){
+    if (c->rbuf == NULL){
+        if ((c->rbuf = malloc(c->rcap)) == NULL){
+            DBG_ERROR("Unable to allocate receive buffer");
+            return -1;
+        }
+        c->roff = 0;
+    }
+    if (c->rcap - c->rlen < len){
+        return -1;
+    }
+    if (c->rcap - c->roff - c->rlen < len){
+        memmove(c->rbuf, c->rbuf + c->roff, c->rlen);
+        c->roff = 0;
+    }
+    memcpy(c->rbuf + c->roff + c->rlen, data, len);
+    c->rlen += len;
+    return 0;
+}
+
+/* a SYN from an unknown peer: create its connection and queue it for gbn_accept */
+static void listener_syn(struct gbn_sock* sk, gbnhdr* syn,
+                         struct sockaddr_storage* from, socklen_t fromlen){
+    gbnhdr hdr;
+    state_t* c;
+    uint8_t opt[SYNOPTLEN];
+    if (!sk->listening || sk->naccept >= sk->backlog){
+        /* the client will resend its SYN */
+        DBG_ERROR("Accept queue full, dropping SYN");
+        return;
+    }
+    if ((c = conn_new(sk, sk->conn)) == NULL){
+        return;
+    }
+    memcpy(&c->addr, from, fromlen);
+    c->len = fromlen;
+    if (conn_insert(sk, c) < 0){
+        conn_free(c);
+        return;
+    }
+    c->state = SYN_RCVD;
+    DBG_PRINT("SYN_RCVD checkpoint");
+    /* every option the client asks for is supported, agree to all of them */
+    /* but FEC next to Selective Repeat, which only resends the lost packet */
+    c->flags = syn->flags & (GBN_F_CRC32C | GBN_F_SACK | GBN_F_FEC);
+    if (c->flags & GBN_F_SACK){
+        c->flags &= ~GBN_F_FEC;
+    }
+    if (syn_payload(syn) < c->payload){
+        c->payload = syn_payload(syn);
+    }
+    init_syn(&hdr, SYNACK, c, opt);
+    if (sendto_hdr(c, &hdr) < 1){
+        DBG_ERROR("Counld not send SYNACK");
+    }
+    c->state = ESTABLISHED;
+    c->ex_seqnum = 0;
+    TRACE(TR_ESTABLISHED, conn_port(c), c->payload, c->flags, 0, 0);
+    /* queue for gbn_accept */
+    if (sk->accept_tail != NULL){
+        sk->accept_tail->qnext = c;
+    }
+    else {
+        sk->accept_head = c;
+    }
+    sk->accept_tail = c;
+    sk->naccept++;
+}
+
+/* copies len bytes to where the waiting gbn_recvv has got to */
+static void uiov_copy(state_t* c, const uint8_t* data, size_t len){
+    size_t n;
+    while (len > 0){
+        const struct iovec* v = &c->uiov[c->uidx];
+        n = v->iov_len - c->uoff < len ? v->iov_len - c->uoff : len;
+        memcpy((char*)v->iov_base + c->uoff, data, n);
+        data += n;
+        len -= n;
+        c->ulen += n;
+        c->uoff += n;
+        if (c->uoff == v->iov_len){
+            c->uidx++;
+            c->uoff = 0;
+        }
+    }
+}
+
+/* in-order data goes to a waiting gbn_recv or to the receive buffer */
+static int deliver(state_t* c, const uint8_t* data, int len){
+    if (c->uiov != NULL && c->rlen == 0 && c->ucap - c->ulen >= len){
+        uiov_copy(c, data, len);
+        return 0;
+    }
+    return rbuf_append(c, data, len);
+}
+
+/* keep a packet that arrived ahead of a hole, if it's in reach */
+static void reorder_hold(state_t* c, gbnhdr* hdr){
+    struct held* h;
+    int i;
+    if (hdr->seqnum - c->ex_seqnum >= REORDER){
+        return;
+    }
+    if (c->held == NULL){
+        /* the slots, then the data of every slot */
+        if ((c->held = malloc((sizeof(struct held) + c->payload) * REORDER)) == NULL){
+            DBG_ERROR("Unable to allocate reorder buffer");
+            return;
+        }
+        for (i = 0; i < REORDER; i++){
+            c->held[i].len = -1;
+            c->held[i].data = (char*)(c->held + REORDER) + (size_t)c->payload * i;
+        }
+    }
+    h = &c->held[hdr->seqnum & (REORDER - 1)];
+    if (h->len < 0){
+        h->seqnum = hdr->seqnum;
+        h->len = hdr->len;
+        memcpy(h->data, hdr->data, hdr->len);
+        c->nheld++;
+    }
+}
+
+/* deliver the held packets that follow the in-order data, returns the */
+/* number delivered. Stops when the receive buffer is full */
+static int reorder_drain(state_t* c){
+    struct held* h;
+    int n = 0;
+    while (c->nheld > 0){
+        h = &c->held[c->ex_seqnum & (REORDER - 1)];
+        if (h->len < 0 || h->seqnum != c->ex_seqnum || deliver(c, (uint8_t*)h->data, h->len) < 0){
+            break;
+        }
+        h->len = -1;
+        c->nheld--;
+        c->ex_seqnum++;
+        n++;
+    }
+    return n;
+}
+
+/*----- Forward error correction -----*/
+/* the DATA packet carrying GBN_F_BLOCK starts a block of k packets, the */
+/* PARITY packet sent after the last one has the block's first seqnum, */
+/* k and the XOR of their lengths (FECHDR), then the XOR of their */
+/* payloads zero-padded to the longest. Blocks follow each other, so the */
+/* receiver also knows a block whose first packet was lost. It XORs the */
+/* block as it comes and keeps what arrives past a single hole, the */
+/* parity then rebuilds the hole. Without duplicate ACKs for the kept packets */
+/* the sender doesn't go back unless the parity couldn't help */
+
+/* XOR a payload into the parity of the block */
+static void fec_xor(state_t* c, const uint8_t* data, int len){
+    /* the parity is only zeroed as far as the payloads reach */
+    if (len > c->fec_max){
+        memset(c->fec_parity + c->fec_max, 0, len - c->fec_max);
+        c->fec_max = len;
+    }
+    xor_bytes(c->fec_parity, data, len);
+    c->fec_len ^= len;
+    c->fec_n++;
+}
+
+/* start collecting the block at seq */
+static void fec_begin(state_t* c, uint32_t seq){
+    c->fec_open = 1;
+    c->fec_start = seq;
+    c->fec_n = 0;
+    c->fec_len = 0;
+    c->fec_max = 0;
+}
+
+/* the block is over, packets still kept past its hole are dropped */
+/* and the sender will resend them */
+static void fec_end(state_t* c){
+    c->stats.ooo_drops += c->fec_nheld;
+    c->fec_nheld = 0;
+    c->fec_open = 0;
+}
+
+/* deliver the packets kept past the hole once it is filled, returns */
+/* the number delivered */
+static int fec_drain(state_t* c){
+    struct held* h;
+    uint32_t i;
+    for (i = 0; i < c->fec_nheld; i++){
+        h = &c->fec_held[i];
+        if (deliver(c, (uint8_t*)h->data, h->len) < 0){
+            c->stats.full_drops += c->fec_nheld - i;
+            break;
+        }
+        c->ex_seqnum++;
+    }
+    c->fec_nheld = 0;
+    return i;
+}
+
+/* an in-order DATA packet may start a block, and goes into the parity */
+/* of the current one. Returns the number of kept packets it let through */
+static int fec_in_order(state_t* c, const gbnhdr* hdr){
+    if (!(c->flags & GBN_F_FEC)){
+        return 0;
+    }
+    if ((hdr->flags & GBN_F_BLOCK) && !(c->fec_open && c->fec_start == hdr->seqnum)){
+        if (c->fec_parity == NULL && (c->fec_parity = malloc(c->payload)) == NULL){
+            DBG_ERROR("Unable to allocate FEC parity");
+            return fec_drain(c);
+        }
+        fec_begin(c, hdr->seqnum);
+        /* packets kept past a block start we didn't expect belong to */
+        /* no parity */
+        c->fec_open = c->fec_nheld == 0;
+    }
+    if (c->fec_open && SEQ_LEQ(c->fec_start, hdr->seqnum)){
+        if (hdr->seqnum - c->fec_start < FEC_MAXK){
+            fec_xor(c, hdr->data, hdr->len);
+        }
+        else {
+            c->fec_open = 0;
+        }
+    }
+    return fec_drain(c);
+}
+
+/* keep a DATA packet past the hole while the parity can still rebuild it, */
+/* i.e. the hole is the block's only one. Returns -1 if it isn't kept */
+static int fec_hold(state_t* c, const gbnhdr* hdr){
+    struct held* h;
+    int i;
+    if (!(c->flags & GBN_F_FEC) || !c->fec_open || SEQ_LT(c->ex_seqnum, c->fec_start)){
+        return -1;
+    }
+    if (hdr->seqnum - c->ex_seqnum <= c->fec_nheld){
+        /* kept already */
+        return 0;
+    }
+    if ((hdr->flags & GBN_F_BLOCK) || hdr->seqnum != c->ex_seqnum + 1 + c->fec_nheld ||
+        hdr->seqnum - c->fec_start >= FEC_MAXK){
+        fec_end(c);
+        return -1;
+    }
+    if (c->fec_held == NULL){
+        /* the slots, then the data of every slot */
+        if ((c->fec_held = malloc((sizeof(struct held) + c->payload) * (FEC_MAXK - 1))) == NULL){
+            DBG_ERROR("Unable to allocate FEC buffer");
+            return -1;
+        }
+        for (i = 0; i < FEC_MAXK - 1; i++){
+            c->fec_held[i].data = (char*)(c->fec_held + FEC_MAXK - 1) + (size_t)c->payload * i;
+        }
+    }
+    h = &c->fec_held[c->fec_nheld++];
+    h->seqnum = hdr->seqnum;
+    h->len = hdr->len;
+    memcpy(h->data, hdr->data, hdr->len);
+    fec_xor(c, hdr->data, hdr->len);
+    return 0;
+}
+
+/* a PARITY packet: with all of its block but the hole XOR'd already it */
+/* rebuilds the hole, which is delivered with the packets kept past it. */
+/* Either way the block is over and the next one starts behind it. */
+/* Returns 1 if the receiver moved on or gave up kept packets, which the */
+/* sender should hear about now */
+static int fec_repair(state_t* c, const gbnhdr* hdr){
+    uint16_t k, len;
+    int moved = c->fec_nheld > 0;
+    if (hdr->len < FECHDR || hdr->len > c->payload){
+        return 0;
+    }
+    memcpy(&k, hdr->data, sizeof(k));
+    k = ntohs(k);
+    if (!c->fec_open || SEQ_LT(hdr->seqnum, c->fec_start)){
+        /* an old parity, or one of a block we weren't collecting: */
+        /* the next block still starts behind it */
+        if (!c->fec_open && c->fec_parity != NULL && SEQ_LEQ(c->ex_seqnum, hdr->seqnum + k)){
+            fec_begin(c, hdr->seqnum + k);
+        }
+        return 0;
+    }
+    memcpy(&len, hdr->data + 2, sizeof(len));
+    len = ntohs(len) ^ c->fec_len;
+    /* every packet of the block but ex_seqnum went into the parity */
+    if (hdr->seqnum == c->fec_start && c->fec_n + 1 == k && SEQ_LEQ(c->fec_start, c->ex_seqnum) &&
+        c->ex_seqnum - c->fec_start + c->fec_nheld + 1 == k &&
+        len > 0 && len <= c->payload && len <= hdr->len - FECHDR){
+        if (len > c->fec_max){
+            memset(c->fec_parity + c->fec_max, 0, len - c->fec_max);
+        }
+        xor_bytes(c->fec_parity, hdr->data + FECHDR, len);
+        if (deliver(c, c->fec_parity, len) < 0){
+            c->stats.full_drops++;
+        }
+        else {
+            c->ex_seqnum++;
+            c->stats.fec_recovered++;
+            TRACE(TR_FEC_REPAIR, conn_port(c), c->ex_seqnum - 1, c->fec_start, k, 0);
+            fec_drain(c);
+            moved = 1;
+        }
+    }
+    fec_end(c);
+    if (SEQ_LEQ(c->ex_seqnum, hdr->seqnum + k)){
+        fec_begin(c, hdr->seqnum + k);
+    }
+    return moved;
+}
+
+/* cumulative ACK of everything before ex_seqnum. With Selective Repeat */
+/* the payload is a bitmap of the held packets: bit i of byte i / 8, */
+/* counting from the least significant bit, is ex_seqnum + 1 + i */
+static void queue_ack(state_t* c){
+    gbnhdr ack;
+    uint8_t* map;
+    uint32_t i, seq;
+    int len = 0;
+    if (c->unacked > 0){
+        hist_add(c->stats.ack_hist, now_usec() - c->ack_first);
+    }
+    c->unacked = 0;
+    c->stats.acks_sent++;
+    TRACE(TR_ACK_OUT, conn_port(c), c->ex_seqnum - 1, 0, 0, 0);
+    if (!(c->flags & GBN_F_SACK)){
+        init_header(&ack, DATAACK, c->ex_seqnum - 1, NULL, 0, c->flags);
+        batch_add(c, &ack);
+        return;
+    }
+    map = batch_payload(c->sock);
+    memset(map, 0, REORDER / 8);
+    for (i = 0; i < REORDER - 1 && c->nheld > 0; i++){
+        seq = c->ex_seqnum + 1 + i;
+        if (c->held[seq & (REORDER - 1)].len >= 0 && c->held[seq & (REORDER - 1)].seqnum == seq){
+            map[i / 8] |= 1 << (i % 8);
+            len = i / 8 + 1;
+        }
+    }
+    init_header(&ack, DATAACK, c->ex_seqnum - 1, (char*)map, len, c->flags);
+    batch_add(c, &ack);
+}
+
+/* ACK every ack_every in-order packets, the delayed ACK timer catches */
+/* the rest once ack_delay has passed */
+static void ack_later(state_t* c){
+    struct gbn_sock* sk = c->sock;
+    if (c->unacked == 0){
+        c->ack_first = now_usec();
+    }
+    if (++c->unacked >= c->ack_every){
+        queue_ack(c);
+        return;
+    }
+    if (!c->ack_queued){
+        c->ack_due = now_usec() + c->ack_delay;
+        c->anext = NULL;
+        if (sk->ack_tail != NULL){
+            sk->ack_tail->anext = c;
+        }
+        else {
+            sk->ack_head = c;
+        }
+        sk->ack_tail = c;
+        c->ack_queued = 1;
+    }
+}
+
+/* queue the delayed ACKs that are due, returns when the next one is, */
+/* 0 if there is none. All connections wait equally long, so the list */
+/* is sorted by due time */
+static uint64_t ack_timers(struct gbn_sock* sk){
+    uint64_t now = 0;
+    state_t* c;
+    while ((c = sk->ack_head) != NULL){
+        if (c->unacked > 0){
+            if (now == 0){
+                now = now_usec();
+            }
+            if (c->ack_due > now){
+                return c->ack_due;
+            }
+            queue_ack(c);
+        }
+        sk->ack_head = c->anext;
+        if (sk->ack_head == NULL){
+            sk->ack_tail = NULL;
+        }
+        c->ack_queued = 0;
+    }
+    return 0;
+}
+
+/* take a closing connection off the delayed ACK list */
+static void ack_unlink(struct gbn_sock* sk, state_t* c){
+    state_t** pp = &sk->ack_head;
+    state_t* prev = NULL;
+    if (!c->ack_queued){
+        return;
+    }
+    while (*pp != c){
+        prev = *pp;
+        pp = &(*pp)->anext;
+    }
+    *pp = c->anext;
+    if (sk->ack_tail == c){
+        sk->ack_tail = prev;
+    }
+    c->ack_queued = 0;
+}
+
+/* plain Go-Back-N: the receiver essentially acts like it has window size 1 */
+/* if any packet received out of order, reject and request last ACKed packet */
+/* with Selective Repeat packets ahead of a hole are held and SACKed */
+static void conn_input(state_t* c, gbnhdr* hdr){
+    gbnhdr ack;
+    switch(hdr->type){
+        case SYN:
+            /* client is still waiting for SYNACK */
+            init_syn(&ack, SYNACK, c, batch_payload(c->sock));
+            break;
+        case FIN:
+            /* client is done, gbn_recv returns 0 once the buffer is drained */
+            c->state = FIN_RCVD;
+            init_header(&ack, FINACK, 0, NULL, 0, c->flags);
+            break;
+        case DATA:
+            if (c->state != ESTABLISHED || hdr->len > c->payload){
+                return;
+            }
+            c->stats.pkts_recv++;
+            c->stats.bytes_recv += hdr->len;
+            TRACE(TR_DATA_IN, conn_port(c), hdr->seqnum, hdr->len, c->ex_seqnum, 0);
+            if (hdr->seqnum == c->ex_seqnum){
+                /* we got the right packet, hand it to a waiting gbn_recv */
+                /* or keep it for the next one */
+                if (deliver(c, hdr->data, hdr->len) < 0){
+                    /* no room left, the sender will resend it */
+                    c->stats.full_drops++;
+                    return;
+                }
+                c->ex_seqnum++;
+                /* a filled hole or one left behind is reported right away */
+                if (reorder_drain(c) == 0 && c->nheld == 0 && fec_in_order(c, hdr) == 0){
+                    ack_later(c);
+                    return;
+                }
+            }
+            else if (SEQ_LT(hdr->seqnum, c->ex_seqnum)){
+                c->stats.dup_drops++;
+            }
+            else if ((c->flags & GBN_F_SACK) && hdr->seqnum - c->ex_seqnum < REORDER){
+                reorder_hold(c, hdr);
+            }
+            else if (fec_hold(c, hdr) == 0){
+                /* the parity may fill the hole, no duplicate ACK yet */
+                return;
+            }
+            else {
+                c->stats.ooo_drops++;
+            }
+            /* duplicate or out of order: ACKs are cumulative, */
+            /* so re-ACK the last in-order packet at once */
+            queue_ack(c);
+            return;
+        case PARITY:
+            if (c->state == ESTABLISHED && (c->flags & GBN_F_FEC) && fec_repair(c, hdr)){
+                queue_ack(c);
+            }
+            return;
+        default:
+            return;
+    }
+    /* goes out with the rest of the batch's ACKs */
+    batch_add(c, &ack);
+}
+
+/* route one packet received on a listening socket to its connection */
+static void listener_input(struct gbn_sock* sk, char* buffer, int count,
+                           struct sockaddr_storage* from, socklen_t fromlen){
+    gbnhdr hdr;
+    state_t* c;
+    state_t tmp;
+    if (parse_hdr(buffer, count, &hdr) < 0){
+        if ((c = conn_lookup(sk, from)) != NULL){
+            c->stats.bad_checksum++;
+        }
+        return;
+    }
+    if ((c = conn_lookup(sk, from)) != NULL){
+        conn_input(c, &hdr);
+    }
+    else if (hdr.type == SYN){
+        listener_syn(sk, &hdr, from, fromlen);
+    }
+    else if (hdr.type == FIN){
+        /* our FINACK got lost and the connection is gone, answer anyway */
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.sock = sk;
+        memcpy(&tmp.addr, from, fromlen);
+        tmp.len = fromlen;
+        init_header(&hdr, FINACK, 0, NULL, 0, hdr.flags & GBN_F_CRC32C);
+        batch_add(&tmp, &hdr);
+    }
+}
+
+static int recv_ready(struct gbn_sock* sk, state_t* c){
+    return c->ulen > 0 || c->rlen > 0 || c->state != ESTABLISHED;
+}
+
+static int recv_full(struct gbn_sock* sk, state_t* c){
+    return c->ulen == c->ucap || c->rlen > 0 || c->state != ESTABLISHED;
+}
+
+static int accept_ready(struct gbn_sock* sk, state_t* c){
+    return sk->accept_head != NULL;
+}
+
+/* feed the n datagrams of the last recvmmsg to their connections */
+static void sock_input(struct gbn_sock* sk, int n){
+    struct gbn_batch* b = sk->rx;
+    int i;
+    for (i = 0; i < n; i++){
+        int off, len = b->msgs[i].msg_len, seg = rx_segsize(b, i);
+        for (off = 0; off < len; off += seg){
+            listener_input(sk, b->bufs[i] + off, len - off < seg ? len - off : seg,
+                           &b->addrs[i], b->msgs[i].msg_hdr.msg_namelen);
+        }
+    }
+}
+
+/* non-blocking mode: take what is queued on a listening socket without */
+/* waiting, unless another thread is reading it, and arm the timer for */
+/* the next delayed ACK. Called with sk->lock held */
+static void sock_pump(struct gbn_sock* sk){
+    int n;
+    if (sk->pumping){
+        return;
+    }
+    do {
+        n = recv_batch(sk, now_usec());
+        sock_input(sk, n);
+    } while (n == sk->rx->cap);
+    sock_arm(sk, ack_timers(sk));
+    batch_flush(sk);
+}
+
+/* wait on a listening socket until ready() holds for connection c */
+/* one thread at a time reads the socket and feeds every connection, */
+/* the others sleep on the condition variable. Called with sk->lock held */
+static int sock_wait(struct gbn_sock* sk, state_t* c, int (*ready)(struct gbn_sock*, state_t*)){
+    int n, ev;
+    uint64_t due;
+    while (!ready(sk, c)){
+        if (sk->pumping){
+            pthread_cond_wait(&sk->cond, &sk->lock);
+            continue;
+        }
+        sk->pumping = 1;
+        /* the timer wakes us up for the next delayed ACK */
+        due = ack_timers(sk);
+        batch_flush(sk);
+        pthread_mutex_unlock(&sk->lock);
+        ev = wait_event(sk, due);
+        pthread_mutex_lock(&sk->lock);
+        /* one recvmmsg per round so waiting threads get to check their condition */
+        n = ev > 0 && (ev & EV_READ) ? recv_batch(sk, now_usec()) : 0;
+        sock_input(sk, n);
+        /* every ACK generated by the batch leaves in one sendmmsg */
+        ack_timers(sk);
+        batch_flush(sk);
+        sk->pumping = 0;
+        pthread_cond_broadcast(&sk->cond);
+        if (ev < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* size the ring and the send buffer for a full window and GBN_SNDBUF. */
+/* Only while nothing is buffered, packets live at their slots */
+static int snd_reserve(state_t* c){
+    uint32_t want = c->sndbuf / c->payload, cap = 1;
+    struct packet* ring;
+    char* sbuf;
+    if (want < c->winsize){
+        want = c->winsize;
+    }
+    if (c->ring != NULL && (c->ring_mask + 1 >= want || c->snd_base != c->ex_seqnum)){
+        return 0;
+    }
+    while (cap < want){
+        cap <<= 1;
+    }
+    if ((ring = realloc(c->ring, sizeof(struct packet) * cap)) == NULL){
+        DBG_ERROR("Unable to allocate window of %d packets", cap);
+        return -1;
+    }
+    c->ring = ring;
+    if ((sbuf = realloc(c->sbuf, (size_t)cap * c->payload)) == NULL){
+        DBG_ERROR("Unable to allocate send buffer of %d packets", cap);
+        return -1;
+    }
+    c->sbuf = sbuf;
+    c->ring_mask = cap - 1;
+    if ((c->flags & GBN_F_FEC) && c->fec_parity == NULL && (c->fec_parity = malloc(c->payload)) == NULL){
+        DBG_ERROR("Unable to allocate FEC parity");
+        return -1;
+    }
+    return 0;
+}
+
+/* queue the PARITY packet of the sender's block, after its last packet */
+/* or once nothing more is waiting to go out. when is its SO_TXTIME */
+/* departure, the parity has no use ahead of the block */
+static void fec_flush(state_t* c, uint64_t when){
+    gbnhdr hdr;
+    uint8_t* p = batch_payload(c->sock);
+    uint16_t v = htons(c->fec_n);
+    memcpy(p, &v, sizeof(v));
+    v = htons(c->fec_len);
+    memcpy(p + 2, &v, sizeof(v));
+    memcpy(p + FECHDR, c->fec_parity, c->fec_max);
+    init_header(&hdr, PARITY, c->fec_start, (char*)p, FECHDR + c->fec_max, c->flags);
+    batch_add(c, &hdr);
+    c->sock->tx->when[c->sock->tx->n - 1] = when;
+    c->stats.fec_sent++;
+    c->fec_n = 0;
+    /* GBN_FEC_AUTO lengthens the blocks while the parity repairs every loss */
+    if (c->fec_auto && c->fec_clean && c->fec_k < FEC_MAXK){
+        c->fec_k++;
+    }
+    c->fec_clean = 1;
+}
+
+/* a loss the parity didn't repair, GBN_FEC_AUTO shortens the blocks */
+/* by a quarter */
+static void fec_loss(state_t* c){
+    if (c->fec_auto){
+        c->fec_k -= c->fec_k / 4;
+        c->fec_clean = 0;
+    }
+}
+
+/* queue one packet of the window for (re)transmission, with its SO_TXTIME */
+/* departure when paced by the qdisc */
+static void queue_packet(state_t* c, struct packet* pack, uint64_t when){
+    gbnhdr hdr;
+    /* first transmissions go out in order, they make up the FEC blocks */
+    if (pack->transmissions == 0){
+        pack->block = (c->flags & GBN_F_FEC) && c->fec_k > 0 && c->fec_n == 0 ? GBN_F_BLOCK : 0;
+    }
+    fill_header(&hdr, DATA, pack->seqnum, pack->start_addr, pack->length, c->flags | pack->block);
+    /* a retransmission reuses the checksum of the first transmission */
+    if (pack->transmissions == 0){
+        set_checksum(&hdr);
+        pack->checksum = hdr.checksum;
+    }
+    else {
+        c->stats.retransmits++;
+    }
+    hdr.checksum = pack->checksum;
+    batch_add(c, &hdr);
+    c->stats.pkts_sent++;
+    c->stats.bytes_sent += pack->length;
+    TRACE(TR_DATA_OUT, conn_port(c), pack->seqnum, pack->length, pack->transmissions + 1, 0);
+    /* timed from now even when the qdisc holds it, which adds at most */
+    /* PACE_HORIZON, so a qdisc ignoring SO_TXTIME can't break the RTT */
+    c->sock->tx->when[c->sock->tx->n - 1] = when;
+    pack->sent = now_usec();
+    if (pack->transmissions++ == 0 && (c->flags & GBN_F_FEC) && (c->fec_n > 0 || c->fec_k > 0)){
+        if (c->fec_n == 0){
+            c->fec_start = pack->seqnum;
+            c->fec_len = 0;
+            c->fec_max = 0;
+        }
+        fec_xor(c, (const uint8_t*)pack->start_addr, pack->length);
+        if (c->fec_n >= (uint32_t)c->fec_k){
+            fec_flush(c, when);
+        }
+    }
+}
+
+/* packets the sender may have in flight: the congestion window, */
+/* bounded by GBN_WINDOW */
+static uint32_t cc_window(state_t* c){
+    if (c->cc.cwnd >= c->winsize){
+        return c->winsize;
+    }
+    return c->cc.cwnd < 1 ? 1 : (uint32_t)c->cc.cwnd;
+}
+
+/* pacing rate in bytes/s: the fixed one, or min(winsize, cwnd) spread */
+/* over an RTT, faster while slow start is still doubling the window that */
+/* limits. 0 without an RTT */
+static double pace_rate(state_t* c){
+    if (c->pace_rate != 0){
+        return c->pace_rate;
+    }
+    if (c->srtt == 0){
+        return 0;
+    }
+    return (c->cc.cwnd < c->cc.ssthresh && c->cc.cwnd < c->winsize ?
+            PACE_GAIN_SS : PACE_GAIN) *
+           cc_window(c) * (HDRLEN + c->payload) * 1e6 / c->srtt;
+}
+
+/* takes the pacing slot of a packet of len bytes. Returns 0 if it may be */
+/* queued now, with *when set to its SO_TXTIME departure (0 right away), */
+/* otherwise the time (nsec) to wait for */
+static uint64_t pace_slot(state_t* c, size_t len, uint64_t* when){
+    double rate;
+    uint64_t now;
+    *when = 0;
+    if (c->pacing == GBN_PACE_OFF || (rate = pace_rate(c)) == 0){
+        return 0;
+    }
+    now = now_nsec();
+    /* a late wakeup catches up at most PACE_SLACK worth of packets */
+    if (c->pace_next + PACE_SLACK < now){
+        c->pace_next = now - PACE_SLACK;
+    }
+    if (c->pace_next > now){
+        if (!c->sock->txtime){
+            return c->pace_next;
+        }
+        /* the qdisc holds the packet, but only so far ahead */
+        if (c->pace_next > now + PACE_HORIZON){
+            return c->pace_next - PACE_HORIZON;
+        }
+        *when = c->pace_next;
+    }
+    c->pace_next += len * 1e9 / rate;
+    return 0;
+}
+
+/* mark the packets a SACK bitmap says the receiver holds, see queue_ack(). */
+/* ack + 1 is the hole the receiver waits for, bit 0 is the packet after it */
+/* the newest packet SACKed for the first time most likely triggered the */
+/* ACK, it gives the RTT sample. Returns the number of packets newly SACKed */
+static int sack_mark(state_t* c, const gbnhdr* ack, uint32_t base, uint32_t next){
+    struct packet* newest = NULL;
+    int i, n = 0;
+    uint32_t seq;
+    for (i = 0; i < ack->len * 8; i++){
+        if (ack->data[i / 8] & (1 << (i % 8))){
+            seq = ack->seqnum + 2 + i;
+            if (SEQ_LEQ(base, seq) && SEQ_LT(seq, next) && !c->ring[seq & c->ring_mask].sacked){
+                newest = &c->ring[seq & c->ring_mask];
+                newest->sacked = 1;
+                n++;
+            }
+        }
+    }
+    if (newest != NULL && newest->transmissions == 1){
+        rtt_sample(c, now_usec() - newest->sent);
+    }
+    return n;
+}
+
+/* Go-Back-N resends from base up to high */
+static void goback(state_t* c, uint32_t base, uint32_t high){
+    c->snd_goback = base;
+    c->snd_goback_high = high;
+    c->snd_goback_at = now_usec();
+    c->dup_count = 0;
+}
+
+/* whether duplicate ACKs during a loss episode make Go-Back-N go back */
+/* again: after a partial ACK they mean another hole, once the resent */
+/* packets are all out or an RTT has passed they mean the retransmission */
+/* was lost. Before that they are for the hole being repaired */
+static int goback_armed(state_t* c, uint32_t base, uint32_t next){
+    return base != c->snd_goback || SEQ_LEQ(c->snd_goback_high, next) ||
+           now_usec() - c->snd_goback_at >= c->srtt;
+}
+
+/* sliding window sender: runs until at most keep packets of the send */
+/* buffer are left un-ACK'd, sending what the windows and the pacer allow, */
+/* taking the ACKs and retransmitting on losses. base is the oldest */
+/* un-ACK'd packet, next the next one to transmit and tail the next one */
+/* to be loaded from the caller's buffer into the ring; seq numbers keep */
+/* counting across calls. Without block it only takes the ACKs already */
+/* queued and leaves the time it has to run again in snd_due, a */
+/* non-blocking socket's timer is armed for it. Returns -1 once the */
+/* retransmission limit is reached */
+static int snd_run(state_t* c, uint32_t keep, int block){
+    uint32_t base = c->snd_base, next = c->snd_next, tail = c->ex_seqnum;
+    /* after going back with a small window the receiver may ACK past next */
+    uint32_t high = c->snd_high;
+    int i, n, acked;
+    uint32_t ack = 0, wnd;
+    int fast;
+    uint64_t paced, when, rto_at, now, deadline;
+    gbnhdr hdr = {0};
+    struct gbn_batch* rx;
+    int ret = 0;
+
+    c->snd_due = 0;
+    while (tail - base > keep){
+        /* on successful sends reset attempts to 0, else on fails increment attempts */
+        if (c->snd_attempts == 10){
+            DBG_ERROR("Attempts limit reached, %d packets un-ACK'd.", tail - base);
+            errno = ETIMEDOUT;
+            ret = -1;
+            break;
+        }
+        /* send everything in the window that hasn't been sent yet, */
+        /* BATCH packets per sendmmsg, as fast as the pacer lets them go */
+        wnd = cc_window(c);
+        paced = 0;
+        while (next != tail && next - base < wnd){
+            struct packet* pack = &c->ring[next & c->ring_mask];
+            if ((paced = pace_slot(c, HDRLEN + pack->length, &when)) != 0){
+                break;
+            }
+            queue_packet(c, pack, when);
+            next++;
+        }
+        /* a block cut short, the receiver shouldn't wait for more */
+        if (next == tail && c->fec_n > 0){
+            fec_flush(c, c->sock->txtime ? c->pace_next : 0);
+        }
+        batch_flush(c->sock);
+        if (SEQ_LT(high, next)){
+            high = next;
+        }
+
+        /* the timer runs for the oldest un-ACK'd packet, if the pacer */
+        /* let any go, or until the pacer lets the next one go */
+        now = now_usec();
+        rto_at = next != base ? c->ring[base & c->ring_mask].sent + c->rto : (uint64_t)-1;
+        deadline = rto_at;
+        if (paced != 0 && (paced + 999) / 1000 < deadline){
+            deadline = (paced + 999) / 1000;
+        }
+        if (!block){
+            /* only what is queued already */
+            n = recv_batch(c->sock, now);
+        }
+        else {
+            n = deadline > now ? recv_batch(c->sock, deadline) : -1;
+        }
+        if (n < 0 && now_usec() < rto_at){
+            if (!block){
+                c->snd_due = deadline != (uint64_t)-1 ? deadline : 0;
+                break;
+            }
+            continue;
+        }
+        rx = c->sock->rx;
+
+        /* ACKs are cumulative, the highest one inside the window slides it forward */
+        acked = 0;
+        fast = 0;
+        for (i = 0; i < n; i++){
+            int off, rlen = rx->msgs[i].msg_len, seg = rx_segsize(rx, i);
+            for (off = 0; off < rlen; off += seg){
+                if (parse_hdr(rx->bufs[i] + off, rlen - off < seg ? rlen - off : seg, &hdr) < 0){
+                    c->stats.bad_checksum++;
+                    continue;
+                }
+                if (hdr.type != DATAACK){
+                    continue;
+                }
+                c->stats.acks_recv++;
+                TRACE(TR_ACK_IN, conn_port(c), hdr.seqnum, base, next, c->cc.cwnd);
+                if (SEQ_LEQ(base, hdr.seqnum) && SEQ_LT(hdr.seqnum, high) &&
+                    (!acked || SEQ_LT(ack, hdr.seqnum))){
+                    ack = hdr.seqnum;
+                    acked = 1;
+                    c->dup_count = 0;
+                }
+                else if (hdr.seqnum == (acked ? ack : base - 1)){
+                    /* the receiver got something past a hole, once per */
+                    /* run of duplicates the hole is filled right away  */
+                    c->stats.dup_acks++;
+                    if (++c->dup_count == c->dup_thresh){
+                        fast = 1;
+                    }
+                }
+                /* a SACK means a hole, and losses mean congestion */
+                if ((c->flags & GBN_F_SACK) && sack_mark(c, &hdr, base, high) > 0 && !c->snd_recovering){
+                    c->cc.ops->on_loss(&c->cc, now_usec());
+                    c->snd_recovering = 1;
+                    c->snd_recover = high;
+                }
+            }
+        }
+        if (acked){
+            struct packet* pack = &c->ring[ack & c->ring_mask];
+            /* Karn's rule: retransmitted packets give ambiguous samples. */
+            /* With Selective Repeat neither does an ACK that jumps over */
+            /* held or retransmitted packets, it was triggered by another one */
+            int clean = pack->transmissions == 1 && !pack->sacked;
+            uint32_t seq;
+            for (seq = base; clean && seq != ack && (c->flags & GBN_F_SACK); seq++){
+                clean = c->ring[seq & c->ring_mask].transmissions == 1;
+            }
+            if (clean){
+                rtt_sample(c, now_usec() - pack->sent);
+            }
+            else if (c->srtt != 0){
+                /* the peer is answering: the backoff goes (RFC 6298 5.7), */
+                /* or with every packet in flight a retransmission Karn's */
+                /* rule would keep it for as long as losses continue */
+                rto_update(c);
+            }
+            c->cc.ops->on_ack(&c->cc, ack + 1 - base, c->srtt, now_usec());
+            if (c->cc.cwnd > c->winsize){
+                c->cc.cwnd = c->winsize;
+            }
+            base = ack + 1;
+            if (SEQ_LT(next, base)){
+                next = base;
+            }
+            c->snd_attempts = 0;
+            if (c->snd_recovering && SEQ_LEQ(c->snd_recover, base)){
+                c->snd_recovering = 0;
+            }
+        }
+        if (fast && next != base && (!c->snd_recovering || (c->flags & GBN_F_SACK) || goback_armed(c, base, next))){
+            /* fast retransmit: the oldest packet goes again now instead */
+            /* of after an rto, and the window is cut like for a SACKed */
+            /* hole rather than collapsed like on a timeout, once per */
+            /* loss episode (NewReno's recover point). Go-Back-N may go */
+            /* back again during the episode, see goback_armed. It */
+            /* resends the whole window, paced over an RTT like any */
+            /* window unless pacing is off: the receiver dropped */
+            /* everything past the hole, so that is intended. Selective */
+            /* Repeat resends one packet and its SACKs already started */
+            /* the recovery */
+            c->stats.fast_retransmits++;
+            TRACE(TR_FAST_RETX, conn_port(c), base, next, c->dup_count, 0);
+            fec_loss(c);
+            if (!c->snd_recovering){
+                c->cc.ops->on_loss(&c->cc, now_usec());
+                c->snd_recovering = 1;
+                c->snd_recover = high;
+            }
+            if (!(c->flags & GBN_F_SACK)){
+                goback(c, base, high);
+                next = base;
+            }
+            else if (!c->ring[base & c->ring_mask].sacked){
+                queue_packet(c, &c->ring[base & c->ring_mask], 0);
+                batch_flush(c->sock);
+            }
+        }
+        else if (fast && !(c->flags & GBN_F_SACK)){
+            /* too early to go back again, the next run of duplicates asks */
+            c->dup_count = 0;
+        }
+        else if (n < 0 && (c->flags & GBN_F_SACK)){
+            /* timed out, Selective Repeat resends only the packets the */
+            /* receiver doesn't hold and that have been out for an rto */
+            uint32_t seq;
+            now = now_usec();
+            for (seq = base; seq != next; seq++){
+                struct packet* pack = &c->ring[seq & c->ring_mask];
+                if (!pack->sacked && (seq == base || pack->sent + c->rto <= now)){
+                    queue_packet(c, pack, 0);
+                }
+            }
+            batch_flush(c->sock);
+            rto_backoff(c);
+            c->stats.timeouts++;
+            TRACE(TR_TIMEOUT, conn_port(c), base, next, c->rto, c->snd_attempts + 1);
+            fec_loss(c);
+            c->cc.ops->on_timeout(&c->cc, now);
+            c->snd_recovering = 1;
+            c->snd_recover = high;
+            c->snd_attempts++;
+        }
+        else if (n < 0){
+            /* timed out, back off and go back to the first un-ACK'd packet */
+            rto_backoff(c);
+            c->stats.timeouts++;
+            TRACE(TR_TIMEOUT, conn_port(c), base, next, c->rto, c->snd_attempts + 1);
+            fec_loss(c);
+            c->cc.ops->on_timeout(&c->cc, now_usec());
+            c->snd_recovering = 1;
+            c->snd_recover = high;
+            goback(c, base, high);
+            next = base;
+            c->snd_attempts++;
+        }
+        /* corrupted packets and stale ACKs are dropped */
+    }
+    c->snd_base = base;
+    c->snd_next = next;
+    c->snd_high = high;
+    maps_release(c, 0);
+    if (c->sock->nonblock){
+        sock_arm(c->sock, c->snd_due);
+    }
+    return ret;
+}
+
+/* copies the data into the send buffer and returns once it is all there, */
+/* blocking only while the buffer is full. The window slides on across */
+/* calls, gbn_close waits for the rest to be ACK'd. A non-blocking socket */
+/* takes what fits and fails with EAGAIN if nothing does */
+ssize_t gbn_send(int sockfd, const void *buf, size_t len, int flags){
+
+    state_t* c = handle_get(sockfd);
+    const char* buffer = (const char*)buf;
+    struct packet* pack;
+    size_t done = 0, n;
+    if (c == NULL){
+        return -1;
+    }
+    /* data only flows from the connecting side */
+    if (c != c->sock->conn){
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (c->state != ESTABLISHED){
+        DBG_ERROR("ESTABLISHED state");
+        return -1;
+    }
+    if (len == 0 && !(flags & MSG_WAITALL)){
+        return 0;
+    }
+    if (snd_reserve(c) < 0){
+        return -1;
+    }
+
+    while (done < len){
+        /* top up the last packet while it hasn't gone out, unless it */
+        /* points into a file */
+        pack = &c->ring[(c->ex_seqnum - 1) & c->ring_mask];
+        if (c->ex_seqnum != c->snd_base && pack->transmissions == 0 && pack->length < c->payload &&
+            pack->start_addr == c->sbuf + (size_t)((c->ex_seqnum - 1) & c->ring_mask) * c->payload){
+            n = len - done < c->payload - pack->length ? len - done : c->payload - pack->length;
+            memcpy((char*)pack->start_addr + pack->length, buffer + done, n);
+            pack->length += n;
+            done += n;
+        }
+        /* then fill free slots */
+        while (done < len && c->ex_seqnum - c->snd_base <= c->ring_mask){
+            pack = &c->ring[c->ex_seqnum & c->ring_mask];
+            pack->start_addr = c->sbuf + (size_t)(c->ex_seqnum & c->ring_mask) * c->payload;
+            pack->length = len - done < c->payload ? len - done : c->payload;
+            memcpy((char*)pack->start_addr, buffer + done, pack->length);
+            pack->seqnum = c->ex_seqnum++;
+            pack->transmissions = 0;
+            pack->sacked = 0;
+            done += pack->length;
+        }
+        if (c->sock->nonblock){
+            /* push, take the ACKs queued and stop if that made no room */
+            if (snd_run(c, 0, 0) < 0){
+                return -1;
+            }
+            if (c->ex_seqnum - c->snd_base > c->ring_mask){
+                break;
+            }
+        }
+        /* wait for room if the buffer is full, otherwise just push */
+        else if (snd_run(c, done < len ? c->ring_mask : 0, done < len) < 0){
+            return -1;
+        }
+    }
+    /* MSG_WAITALL waits until everything sent so far is ACK'd, a */
+    /* non-blocking call with len 0 fails with EAGAIN until then */
+    if (flags & MSG_WAITALL){
+        if (snd_run(c, 0, !c->sock->nonblock) < 0){
+            return -1;
+        }
+        if (len == 0){
+            if (c->snd_base != c->ex_seqnum){
+                errno = EAGAIN;
+                return -1;
+            }
+            return 0;
+        }
+    }
+    DBG_PRINT("Exiting out of gbn_send");
+    if (done == 0){
+        errno = EAGAIN;
+        return -1;
+    }
+    return done;
+}
+
+/* sends count bytes of the file fd from offset without copying them: */
+/* packets point into MAPLEN bytes of the file mapped at a time, which */
+/* stay mapped until they are ACK'd, so retransmissions read the page */
+/* cache. Returns like gbn_send, short at the end of the file */
+ssize_t gbn_sendfile(int sockfd, int fd, off_t offset, size_t count){
+    state_t* c = handle_get(sockfd);
+    long page = sysconf(_SC_PAGESIZE);
+    struct packet* pack;
+    struct gbn_map* m;
+    struct stat st;
+    size_t done = 0, chunk, skew, left;
+    uint32_t room;
+    const char* p;
+    if (c == NULL){
+        return -1;
+    }
+    if (c != c->sock->conn){
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (c->state != ESTABLISHED){
+        DBG_ERROR("ESTABLISHED state");
+        return -1;
+    }
+    if (offset < 0){
+        errno = EINVAL;
+        return -1;
+    }
+    if (fstat(fd, &st) < 0){
+        return -1;
+    }
+    /* touching a mapping past the end of the file raises SIGBUS */
+    if (offset >= st.st_size){
+        return 0;
+    }
+    if (count > (size_t)(st.st_size - offset)){
+        count = st.st_size - offset;
+    }
+    if (snd_reserve(c) < 0){
+        return -1;
+    }
+
+    while (done < count){
+        /* whole packets per mapping, which starts on a page */
+        chunk = count - done < MAPLEN ? count - done : MAPLEN / c->payload * c->payload;
+        if (c->sock->nonblock){
+            /* only what fits now, the mapping must end with its last packet */
+            if (c->ex_seqnum - c->snd_base > c->ring_mask && snd_run(c, 0, 0) < 0){
+                return -1;
+            }
+            room = c->ring_mask + 1 - (c->ex_seqnum - c->snd_base);
+            if (room == 0){
+                errno = EAGAIN;
+                break;
+            }
+            if (chunk > (size_t)room * c->payload){
+                chunk = (size_t)room * c->payload;
+            }
+        }
+        skew = (offset + done) % page;
+        if ((m = malloc(sizeof(struct gbn_map))) == NULL){
+            DBG_ERROR("Unable to allocate mapping");
+            break;
+        }
+        m->len = chunk + skew;
+        m->addr = mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, offset + done - skew);
+        if (m->addr == MAP_FAILED){
+            DBG_ERROR("Unable to map %d bytes of the file", (int)m->len);
+            free(m);
+            break;
+        }
+        madvise(m->addr, m->len, MADV_SEQUENTIAL);
+        madvise(m->addr, m->len, MADV_WILLNEED);
+        m->last = c->ex_seqnum + (chunk + c->payload - 1) / c->payload - 1;
+        m->next = NULL;
+        if (c->maps_tail != NULL){
+            c->maps_tail->next = m;
+        }
+        else {
+            c->maps = m;
+        }
+        c->maps_tail = m;
+
+        for (p = m->addr + skew, left = chunk; left > 0; p += pack->length, left -= pack->length){
+            /* wait for a free slot */
+            if (c->ex_seqnum - c->snd_base > c->ring_mask && snd_run(c, c->ring_mask, 1) < 0){
+                return -1;
+            }
+            pack = &c->ring[c->ex_seqnum & c->ring_mask];
+            pack->start_addr = p;
+            pack->length = left < c->payload ? left : c->payload;
+            pack->seqnum = c->ex_seqnum++;
+            pack->transmissions = 0;
+            pack->sacked = 0;
+            done += pack->length;
+        }
+        if (snd_run(c, 0, 0) < 0){
+            return -1;
+        }
+    }
+    if (done == 0 && count > 0){
+        return -1;
+    }
+    return done;
+}
+
+/* data arrives through the listening socket, which may be feeding */
+/* other connections from other threads at the same time */
+ssize_t gbn_recv(int sockfd, void *buf, size_t len, int flags){
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return gbn_recvv(sockfd, &iov, 1, flags);
+}
+
+/* in-order data goes into the iovecs: first what is buffered, then what */
+/* arrives while waiting, written there directly. Returns as soon as there */
+/* is some, with MSG_WAITALL once they are full, and 0 at the end. A */
+/* non-blocking socket takes what is queued and fails with EAGAIN if */
+/* that is nothing */
+ssize_t gbn_recvv(int sockfd, const struct iovec *iov, int iovcnt, int flags){
+    state_t* c = handle_get(sockfd);
+    struct gbn_sock* sk;
+    ssize_t count = -1;
+    size_t n;
+    int i, pumped = 0;
+    if (c == NULL){
+        return -1;
+    }
+    sk = c->sock;
+    /* only accepted connections receive data */
+    if (c == sk->conn){
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (iovcnt < 0){
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&sk->lock);
+    c->uiov = iov;
+    c->uidx = 0;
+    c->uoff = 0;
+    c->ulen = 0;
+    c->ucap = 0;
+    for (i = 0; i < iovcnt; i++){
+        c->ucap += iov[i].iov_len;
+    }
+    for (;;){
+        if (c->rlen > 0){
+            n = c->rlen < c->ucap - c->ulen ? c->rlen : c->ucap - c->ulen;
+            uiov_copy(c, (uint8_t*)c->rbuf + c->roff, n);
+            c->roff += n;
+            c->rlen -= n;
+            /* held packets that didn't fit before, tell the sender */
+            if (reorder_drain(c) > 0){
+                queue_ack(c);
+                batch_flush(sk);
+            }
+        }
+        if (c->ulen == c->ucap || (c->ulen > 0 && !(flags & MSG_WAITALL))){
+            count = c->ulen;
+            break;
+        }
+        if (c->state != ESTABLISHED){
+            /* client sent FIN and everything was read */
+            count = c->ulen;
+            break;
+        }
+        if (sk->nonblock){
+            if (!pumped){
+                sock_pump(sk);
+                pumped = 1;
+                continue;
+            }
+            if (c->ulen == 0){
+                errno = EAGAIN;
+            }
+            count = c->ulen > 0 ? (ssize_t)c->ulen : -1;
+            break;
+        }
+        if (sock_wait(sk, c, (flags & MSG_WAITALL) ? recv_full : recv_ready) != 0){
+            count = c->ulen > 0 ? (ssize_t)c->ulen : -1;
+            break;
+        }
+    }
+    DBG_PRINT("gbn_recv returning %d bytes", (int)count);
+    c->uiov = NULL;
+    c->ulen = 0;
+    pthread_mutex_unlock(&sk->lock);
+    return count;
+}
+
+/* the client's side of gbn_close: the buffered data goes out, then the */
+/* FIN until a FINACK comes back. Without block it returns -1 with EAGAIN */
+/* while it waits, and picks up from there on the next call */
+static int close_run(state_t* c, int block){
+    int count;
+    gbnhdr hdr = {0};
+    char buffer[HDRLEN + SYNOPTLEN];
+    uint64_t deadline;
+
+    /* everything buffered goes out before the FIN */
+    if (c->state == ESTABLISHED && c->ring != NULL && c->snd_attempts < 10 && c->snd_base != c->ex_seqnum){
+        if (snd_run(c, 0, block) < 0){
+            DBG_ERROR("Buffered data lost, closing anyway");
+        }
+        else if (c->snd_base != c->ex_seqnum){
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    while (c->state != CLOSED){
+        if (c->hs_attempts == 10) break;
+        switch(c->state){
+            case ESTABLISHED:   /* this must be client, send first FIN */
+                init_header(&hdr, FIN, 0, NULL, 0, c->flags);
+                if ((count = sendto_maybe_hdr(c, &hdr)) < 1){
+                    DBG_ERROR("Error occured while sending");
+                    c->hs_attempts++;
+                    continue;
+                }
+                c->state = FIN_SENT;
+                c->hs_sent = now_usec();
+                break;
+            case FIN_SENT:      /* client waits for FINACK to respond */
+                deadline = c->hs_sent + c->rto;
+                count = recvfrom_hdr(c, &hdr, FINACK, 0, block ? deadline : now_usec(), buffer, sizeof(buffer));
+                if (count < 1 && count != -1 && now_usec() < deadline){
+                    /* a stale packet in front of the FINACK */
+                    continue;
+                }
+                if (count == -1 && !block && now_usec() < deadline){
+                    /* nothing yet */
+                    sock_arm(c->sock, deadline);
+                    errno = EAGAIN;
+                    return -1;
+                }
+                if (count < 1){
+                    DBG_ERROR("Error occured while waiting for recvfrom");
+                    rto_backoff(c);
+                    c->stats.timeouts++;
+                    c->state = ESTABLISHED;
+                    c->hs_attempts++;
+                    continue;
+                }
+                c->state = CLOSED;
+                break;
+            default:
+                c->state = CLOSED;
+                break;
+        }
+    }
+    if (c->hs_attempts == 10){     /* max amount of attempts reached, hang up */
+        DBG_ERROR("Attempts limit reached. State: %d.", c->state);
+    }
+    return 0;
+}
+
+/* Send FIN, Recv FIN, Send FINACK, Recv FINACK */
+/* implemented with two way hand shake */
+int gbn_close(int sockfd){
+    state_t* c = handle_get(sockfd);
+    struct gbn_sock* sk;
+    int lost;
+    if (c == NULL){
+        return -1;
+    }
+    sk = c->sock;
+
+    if (c != sk->conn){
+        /* accepted connection, FINACK went out when the FIN arrived */
+        pthread_mutex_lock(&sk->lock);
+        conn_remove(sk, c);
+        ack_unlink(sk, c);
+        c->state = CLOSED;
+        pthread_mutex_unlock(&sk->lock);
+        TRACE(TR_CLOSED, conn_port(c), c->stats.pkts_sent, c->stats.pkts_recv, 0, 0);
+        handle_set(sockfd, NULL);
+        close(sockfd);
+        conn_free(c);
+        sock_release(sk);
+        return 0;
+    }
+    if (sk->listening){
+        /* listening socket, stop accepting. The UDP socket stays open */
+        /* until every accepted connection is closed */
+        pthread_mutex_lock(&sk->lock);
+        sk->listening = 0;
+        pthread_mutex_unlock(&sk->lock);
+        handle_set(sockfd, NULL);
+        sock_release(sk);
+        return 0;
+    }
+
+    /* a non-blocking client comes back here until the FIN is answered */
+    c->closing = 1;
+    if (close_run(c, !sk->nonblock) < 0){
+        return -1;
+    }
+    lost = c->hs_attempts == 10 || c->snd_attempts == 10;
+    TRACE(TR_CLOSED, conn_port(c), c->stats.pkts_sent, c->stats.pkts_recv, 0, 0);
+    handle_set(sockfd, NULL);
+    sock_release(sk);
+    return lost ? -2 : 0;
+}
+
+/* the client's side of the handshake: the SYN until a SYNACK comes back. */
+/* Without block it returns -1 with EINPROGRESS while it waits, and */
+/* picks up from there on the next call */
+static int connect_run(state_t* c, int block){
+    int count;
+    gbnhdr hdr = {0};
+    uint8_t opt[SYNOPTLEN];
+    char buffer[HDRLEN + SYNOPTLEN];
+    uint64_t deadline;
+
+    /* FSM starts here, try 10 times */
+    while (c->state != ESTABLISHED) {
+        if (c->hs_attempts == 10) break;
+        switch (c->state){
+            case CLOSED:
+                /* setup SYN packet, it offers our largest payload */
+                init_syn(&hdr, SYN, c, opt);
+                DBG_PRINT("Checksum: %d", hdr.checksum);
+                if (sendto_maybe_hdr(c, &hdr) < 1){
+                    DBG_ERROR("An error occured sending SYN");
+                    c->hs_attempts++;
+                    continue;
+                }
+                DBG_PRINT("SYN_SENT Checkpoint");
+                /* update state variables */
+                c->state = SYN_SENT;
+                c->hs_sent = now_usec();
+                break;
+            case SYN_SENT:
+                deadline = c->hs_sent + c->rto;
+                count = recvfrom_hdr(c, &hdr, SYNACK, 0, block ? deadline : now_usec(), buffer, sizeof(buffer));
+                if (count < 1 && count != -1 && now_usec() < deadline){
+                    /* a stale or corrupted packet in front of the SYNACK */
+                    continue;
+                }
+                if (count == -1 && !block && now_usec() < deadline){
+                    /* nothing yet */
+                    sock_arm(c->sock, deadline);
+                    errno = EINPROGRESS;
+                    return -1;
+                }
+                if (count < 1){
+                    DBG_ERROR("Did not receive FINACK");
+                    rto_backoff(c);
+                    c->stats.timeouts++;
+                    c->hs_attempts++;
+                    /* reset set to CLOSED and resend */
+                    c->state = CLOSED;
+                    continue;
+                }
+                DBG_PRINT("ESTABLISHED Checkpoint");
+                /* the server agrees to the options it supports */
+                /* and to the smaller of the two payloads */
+                c->flags &= hdr.flags;
+                if (syn_payload(&hdr) < c->payload){
+                    c->payload = syn_payload(&hdr);
+                }
+                /* a PARITY packet is FECHDR longer than the DATA it covers */
+                if (c->flags & GBN_F_FEC){
+                    c->payload -= FECHDR;
+                }
+                /* the handshake seeds the estimator, unless the SYN was resent */
+                if (c->hs_attempts == 0){
+                    rtt_sample(c, now_usec() - c->hs_sent);
+                }
+                c->state = ESTABLISHED;
+                c->ex_seqnum = 0;
+                c->hs_attempts = 0;
+                TRACE(TR_ESTABLISHED, conn_port(c), c->payload, c->flags, 0, 0);
+                break;
+            case ESTABLISHED:
+                break;
+        }
+    }
+    if (c->hs_attempts == 10) {
+        DBG_ERROR("Server hung up first!");
+        errno = ETIMEDOUT;
+        return -2;
+    }
+    if (c->sock->nonblock){
+        sock_arm(c->sock, 0);
+    }
+    return 0;
+}
+
+/* SYN, SYNACK packets will only compose of type and checksum field, no seqnum and data */
+int gbn_connect(int sockfd, const struct sockaddr *server, socklen_t socklen){
+    state_t* c = handle_get(sockfd);
+    if (c == NULL){
+        return -1;
+    }
+    if (socklen > sizeof(c->addr)){
+        errno = EINVAL;
+        return -1;
+    }
+    /* save server address */
+    memcpy(&c->addr, server, socklen);
+    c->len = socklen;
+    if (c->pmtu){
+        pmtu_clamp(c);
+    }
+    return connect_run(c, !c->sock->nonblock);
+}
+
 int gbn_listen(int sockfd, int backlog){
+    state_t* c = handle_get(sockfd);
+    struct gbn_sock* sk;
+    if (c == NULL){
+        return -1;
+    }
+    sk = c->sock;
+    pthread_mutex_lock(&sk->lock);
+    if (sk->table == NULL){
+        sk->table_mask = 63;
+        if ((sk->table = calloc(sk->table_mask + 1, sizeof(state_t*))) == NULL){
+            pthread_mutex_unlock(&sk->lock);
+            DBG_ERROR("Unable to allocate the connection table");
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    sk->backlog = backlog > 0 ? backlog : BACKLOG;
+    sk->listening = 1;
+    pthread_mutex_unlock(&sk->lock);
 	return 0;
 }
 
@@ -487,87 +2441,485 @@ int gbn_bind(int sockfd, const struct sockaddr *server, socklen_t socklen){
         DBG_ERROR("Unable to bind to socket");
     }
 	return ret;
-}	
+}
 
 int gbn_socket(int domain, int type, int protocol){
-		
-	/*----- Randomizing the seed. This is used by the rand() function -----*/
-	srand((unsigned)time(0));
-    /* state at socket creation is always close (not connected) */
-    s.state = CLOSED;
     /* return file descriptor for the socket */
     int fd = 0;
+    struct epoll_event ev;
+    struct gbn_sock* sk;
+    const char* spec = getenv("GBN_IMPAIR");
     if ((fd = socket(domain, type, protocol)) < 0){
         /* file descriptor can't be negative */
         DBG_ERROR("Unable to create socket");
+        return fd;
     }
+    if ((sk = calloc(1, sizeof(struct gbn_sock))) == NULL){
+        DBG_ERROR("Unable to allocate socket");
+        close(fd);
+        return -1;
+    }
+    sk->fd = fd;
+    sk->refs = 1;
+    pthread_mutex_init(&sk->lock, NULL);
+    pthread_cond_init(&sk->cond, NULL);
+    /* state at socket creation is always close (not connected) */
+    sk->conn = conn_new(sk, NULL);
+    sk->maxdata = DATALEN;
+    sk->tx = batch_new(HDRLEN + sk->maxdata, BATCH);
+    sk->rx = batch_new(HDRLEN + sk->maxdata, BATCH);
+    /* timeouts come from a timerfd polled together with the socket */
+    sk->epfd = epoll_create1(EPOLL_CLOEXEC);
+    sk->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ERR_CHECK(sk->conn != NULL, "Unable to allocate connection");
+    ERR_CHECK(sk->tx != NULL && sk->rx != NULL, "Unable to allocate batches");
+    ERR_CHECK(sk->epfd >= 0 && sk->tfd >= 0, "Unable to create event loop");
+    if (impair_new(spec != NULL ? spec : IMPAIR_DEFAULT, &sk->imp) < 0){
+        DBG_ERROR("Bad GBN_IMPAIR");
+        goto error_exit;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    ERR_CHECK(epoll_ctl(sk->epfd, EPOLL_CTL_ADD, fd, &ev) == 0, "Unable to poll socket");
+    ev.data.fd = sk->tfd;
+    ERR_CHECK(epoll_ctl(sk->epfd, EPOLL_CTL_ADD, sk->tfd, &ev) == 0, "Unable to poll timer");
+    ERR_CHECK(handle_set(fd, sk->conn) == 0, "Unable to register socket");
 	return fd;
-}
 
-int gbn_accept(int sockfd, struct sockaddr *client, socklen_t *socklen){
-    int count = 0;
-    gbnhdr hdr = {0};
+error_exit:
+    if (sk->epfd >= 0) close(sk->epfd);
+    if (sk->tfd >= 0) close(sk->tfd);
+    if (sk->conn != NULL) conn_free(sk->conn);
+    impair_free(sk->imp);
+    batch_free(sk->tx);
+    batch_free(sk->rx);
+    pthread_mutex_destroy(&sk->lock);
+    pthread_cond_destroy(&sk->cond);
+    free(sk);
+    close(fd);
+    return -1;
+}
 
-    /* FSM starts here */
-    while (s.state != ESTABLISHED){
-        switch(s.state){
-            case CLOSED:
-                if ((count = recvfrom_hdr(sockfd, &hdr, SYN, 0, client, socklen, 0)) < 1){
-                    DBG_ERROR("Did not receive the SYN packet");
-                    continue;
+int gbn_setsockopt(int sockfd, int optname, const void *optval, socklen_t optlen){
+    int val, ret = 0;
+    state_t* c = handle_get(sockfd);
+    if (c == NULL){
+        return -1;
+    }
+    if (optval == NULL || optlen != sizeof(int)){
+        errno = EINVAL;
+        return -1;
+    }
+    val = *(const int*)optval;
+    pthread_mutex_lock(&c->sock->lock);
+    switch(optname){
+        case GBN_WINDOW:
+            if (val < 1 || val > MAXWIN){
+                DBG_ERROR("Window size %d out of range", val);
+                ret = EINVAL;
+                break;
+            }
+            c->winsize = val;
+            break;
+        case GBN_RTO_MIN:
+            if (val < 1 || val > c->rto_max){
+                DBG_ERROR("Minimum rto %d out of range", val);
+                ret = EINVAL;
+                break;
+            }
+            c->rto_min = val;
+            clamp_rto(c);
+            break;
+        case GBN_RTO_MAX:
+            if (val < c->rto_min){
+                DBG_ERROR("Maximum rto %d out of range", val);
+                ret = EINVAL;
+                break;
+            }
+            c->rto_max = val;
+            clamp_rto(c);
+            break;
+        case GBN_RCVBUF:
+            /* must hold at least one packet and whatever is buffered */
+            if (val < c->payload || val < c->rlen){
+                DBG_ERROR("Receive buffer %d out of range", val);
+                ret = EINVAL;
+                break;
+            }
+            if (c->rbuf != NULL){
+                char* rbuf;
+                memmove(c->rbuf, c->rbuf + c->roff, c->rlen);
+                c->roff = 0;
+                if ((rbuf = realloc(c->rbuf, val)) == NULL){
+                    ret = ENOMEM;
+                    break;
                 }
-                memcpy(&s.addr, client, *socklen);
-                s.len = *socklen;
-                s.state = SYN_RCVD;
-                DBG_PRINT("SYN_RCVD checkpoint");
+                c->rbuf = rbuf;
+            }
+            c->rcap = val;
+            break;
+        case GBN_REUSEPORT:
+            /* the kernel hashes each flow to one of the sockets sharing the port */
+            if (setsockopt(c->sock->fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0){
+                ret = errno;
+                DBG_ERROR("Unable to set SO_REUSEPORT");
+            }
+            break;
+        case GBN_CPU:
+            if (setsockopt(c->sock->fd, SOL_SOCKET, SO_INCOMING_CPU, &val, sizeof(val)) < 0){
+                ret = errno;
+                DBG_ERROR("Unable to set SO_INCOMING_CPU");
+            }
+            break;
+        case GBN_CRC32C:
+            if (val){
+                c->flags |= GBN_F_CRC32C;
+            }
+            else {
+                c->flags &= ~GBN_F_CRC32C;
+            }
+            break;
+        case GBN_ACK_EVERY:
+            if (val < 1){
+                DBG_ERROR("ACK interval %d out of range", val);
+                ret = EINVAL;
                 break;
-            case SYN_RCVD:
-                init_header(&hdr, SYNACK, 0, NULL, 0);
-                if (sendto_hdr(sockfd, &hdr, sizeof(gbnhdr)) < 1){
-                    DBG_ERROR("Counld not send SYNACK");
-                    continue;
+            }
+            c->ack_every = val;
+            break;
+        case GBN_ACK_DELAY:
+            if (val < 0){
+                DBG_ERROR("ACK delay %d out of range", val);
+                ret = EINVAL;
+                break;
+            }
+            c->ack_delay = val;
+            break;
+        case GBN_PACING:
+            if (val != GBN_PACE_OFF && val != GBN_PACE_USER && val != GBN_PACE_TXTIME){
+                DBG_ERROR("Unknown pacing mode %d", val);
+                ret = EINVAL;
+                break;
+            }
+            c->sock->txtime = 0;
+            if (val == GBN_PACE_TXTIME){
+                struct sock_txtime st;
+                st.clockid = CLOCK_MONOTONIC;
+                st.flags = 0;
+                if (setsockopt(c->sock->fd, SOL_SOCKET, SO_TXTIME, &st, sizeof(st)) < 0){
+                    DBG_ERROR("SO_TXTIME not supported, pacing in userspace");
+                    val = GBN_PACE_USER;
+                }
+                else {
+                    c->sock->txtime = 1;
                 }
-                s.state = ESTABLISHED;
-                s.ex_seqnum = 0;
-                DBG_PRINT("ESTABLISHED checkpoint");
+            }
+            c->pacing = val;
+            break;
+        case GBN_PAYLOAD:
+            /* a whole packet must fit in the receive buffer */
+            if (val < MINDATALEN || val > MAXDATALEN || val > c->rcap || c->state != CLOSED){
+                DBG_ERROR("Payload %d out of range", val);
+                ret = EINVAL;
                 break;
-            case ESTABLISHED:
+            }
+            if (sock_resize(c->sock, val) < 0){
+                ret = ENOMEM;
+                break;
+            }
+            c->payload = val;
+            break;
+        case GBN_SNDBUF:
+            /* takes effect when the buffer is empty */
+            if (val < 1){
+                DBG_ERROR("Send buffer %d out of range", val);
+                ret = EINVAL;
+                break;
+            }
+            c->sndbuf = val;
+            break;
+        case GBN_PMTU:
+            c->pmtu = val != 0;
+            break;
+        case GBN_NONBLOCK:
+            /* the socket's, so accepted connections share it */
+            c->sock->nonblock = val != 0;
+            break;
+        case GBN_DUPTHRESH:
+            if (val < 0){
+                DBG_ERROR("Duplicate ACK threshold %d out of range", val);
+                ret = EINVAL;
+                break;
+            }
+            c->dup_thresh = val;
+            break;
+        case GBN_PACE_RATE:
+            if (val < 0){
+                DBG_ERROR("Pacing rate %d out of range", val);
+                ret = EINVAL;
+                break;
+            }
+            c->pace_rate = val;
+            break;
+        case GBN_CC:
+            if (cc_find(val) == NULL){
+                DBG_ERROR("Unknown congestion controller %d", val);
+                ret = EINVAL;
+                break;
+            }
+            c->cc.ops = cc_find(val);
+            c->cc.ops->init(&c->cc);
+            break;
+        case GBN_SACK:
+            if (val){
+                c->flags |= GBN_F_SACK;
+            }
+            else {
+                c->flags &= ~GBN_F_SACK;
+            }
+            break;
+        case GBN_FEC:
+            if (val != 0 && val != GBN_FEC_AUTO && (val < FEC_MINK || val > FEC_MAXK)){
+                DBG_ERROR("FEC blocks are %d to %d packets", FEC_MINK, FEC_MAXK);
+                ret = EINVAL;
                 break;
+            }
+            /* asks for FEC before the handshake, after it only sets the ratio */
+            if (c->state == CLOSED){
+                if (val){
+                    c->flags |= GBN_F_FEC;
+                }
+                else {
+                    c->flags &= ~GBN_F_FEC;
+                }
+            }
+            c->fec_auto = val == GBN_FEC_AUTO;
+            c->fec_k = c->fec_auto ? FEC_K : val;
+            break;
+        case GBN_GSO:
+            /* without kernel support bursts simply stay plain datagrams */
+            c->sock->gso = 0;
+            if (val){
+                int seg;
+                socklen_t seglen = sizeof(seg);
+                if (getsockopt(c->sock->fd, SOL_UDP, UDP_SEGMENT, &seg, &seglen) == 0){
+                    c->sock->gso = 1;
+                }
+                else {
+                    DBG_ERROR("UDP GSO not supported, sending plain datagrams");
+                }
+            }
+            break;
+        case GBN_GRO:
+            if (setsockopt(c->sock->fd, SOL_UDP, UDP_GRO, &val, sizeof(val)) < 0){
+                DBG_ERROR("UDP GRO not supported, receiving plain datagrams");
+                val = 0;
+            }
+            if (!val != !c->sock->gro){
+                /* coalesced datagrams need bigger receive slots */
+                struct gbn_batch* rx = val ? batch_new(GROLEN, GROBATCH)
+                                           : batch_new(HDRLEN + c->sock->maxdata, BATCH);
+                if (rx == NULL){
+                    ret = ENOMEM;
+                    break;
+                }
+                batch_free(c->sock->rx);
+                c->sock->rx = rx;
+                c->sock->gro = val != 0;
+            }
+            break;
+        default:
+            ret = ENOPROTOOPT;
+    }
+    pthread_mutex_unlock(&c->sock->lock);
+    if (ret != 0){
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+/* wait for a client on a listening socket, the returned handle is a */
+/* dup() of the socket so it is a real fd unique to the connection */
+int gbn_accept(int sockfd, struct sockaddr *client, socklen_t *socklen){
+    state_t* l = handle_get(sockfd);
+    struct gbn_sock* sk;
+    state_t* c;
+    int fd;
+    if (l == NULL){
+        return -1;
+    }
+    sk = l->sock;
+    pthread_mutex_lock(&sk->lock);
+    if (!sk->listening || l != sk->conn){
+        pthread_mutex_unlock(&sk->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    if (sk->nonblock){
+        if (sk->accept_head == NULL){
+            sock_pump(sk);
+        }
+        if (sk->accept_head == NULL){
+            pthread_mutex_unlock(&sk->lock);
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    else if (sock_wait(sk, NULL, accept_ready) < 0){
+        pthread_mutex_unlock(&sk->lock);
+        return -1;
+    }
+    c = sk->accept_head;
+    sk->accept_head = c->qnext;
+    if (sk->accept_head == NULL){
+        sk->accept_tail = NULL;
+    }
+    c->qnext = NULL;
+    sk->naccept--;
+    if ((fd = dup(sk->fd)) < 0 || handle_set(fd, c) < 0){
+        DBG_ERROR("Unable to create a handle for the connection");
+        conn_remove(sk, c);
+        pthread_mutex_unlock(&sk->lock);
+        if (fd >= 0) close(fd);
+        conn_free(c);
+        return -1;
+    }
+    sk->refs++;
+    pthread_mutex_unlock(&sk->lock);
+
+    if (client != NULL && socklen != NULL){
+        memcpy(client, &c->addr, *socklen < c->len ? *socklen : c->len);
+        *socklen = c->len;
+    }
+    return fd;
+}
+
+/* the fd to wait on in an event loop: an epoll set of the UDP socket */
+/* and the timer, readable when either needs gbn_process_timers. It is */
+/* the same for a listening socket and all its connections */
+int gbn_fd(int sockfd){
+    state_t* c = handle_get(sockfd);
+    if (c == NULL){
+        return -1;
+    }
+    return c->sock->epfd;
+}
+
+/* GBN_POLL* bits of what the handle is ready for, it never waits */
+int gbn_poll(int sockfd){
+    state_t* c = handle_get(sockfd);
+    struct gbn_sock* sk;
+    int ev = 0;
+    if (c == NULL){
+        return -1;
+    }
+    sk = c->sock;
+    if (c != sk->conn || sk->listening){
+        pthread_mutex_lock(&sk->lock);
+        if (c != sk->conn ? c->rlen > 0 || c->state != ESTABLISHED : sk->accept_head != NULL){
+            ev |= GBN_POLLIN;
         }
+        pthread_mutex_unlock(&sk->lock);
+    }
+    else if (c->hs_attempts == 10 || c->snd_attempts == 10){
+        ev |= GBN_POLLERR;
+    }
+    else if (c->closing){
+        ev |= c->state == CLOSED ? GBN_POLLHUP : 0;
+    }
+    else if (c->state == ESTABLISHED && (c->ring == NULL || c->ex_seqnum - c->snd_base <= c->ring_mask)){
+        ev |= GBN_POLLOUT;
+    }
+    return ev;
+}
+
+/* copies the statistics of the connection of a handle, a listening */
+/* socket has none of its own */
+int gbn_getstats(int sockfd, struct gbn_stats* st){
+    state_t* c = handle_get(sockfd);
+    struct gbn_sock* sk;
+    if (c == NULL){
+        return -1;
+    }
+    sk = c->sock;
+    if (c != sk->conn || sk->listening){
+        /* the thread reading the socket updates accepted connections */
+        pthread_mutex_lock(&sk->lock);
+        *st = c->stats;
+        pthread_mutex_unlock(&sk->lock);
+    }
+    else {
+        *st = c->stats;
+    }
+    return 0;
+}
+
+/* does what the blocking calls do while they wait: takes the packets */
+/* queued on the socket, resends on timeouts, sends the packets the pacer */
+/* held back and the delayed ACKs, and arms the timer for the next time. */
+/* Call it when gbn_fd is readable. -1 with ETIMEDOUT once the peer is gone */
+int gbn_process_timers(int sockfd){
+    state_t* c = handle_get(sockfd);
+    struct gbn_sock* sk;
+    uint64_t expirations;
+    int ret = 0;
+    if (c == NULL){
+        return -1;
+    }
+    sk = c->sock;
+    if (read(sk->tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN){
+        DBG_ERROR("Unable to read timer");
+    }
+    if (sk->imp != NULL){
+        /* the timer may have fired for held datagrams only, keep it on */
+        /* whatever the calls below leave armed */
+        impair_release(sk->imp);
+        sock_arm(sk, sk->due);
+    }
+    if (c != sk->conn || sk->listening){
+        pthread_mutex_lock(&sk->lock);
+        sock_pump(sk);
+        pthread_mutex_unlock(&sk->lock);
+        return 0;
+    }
+    if (c->state == SYN_SENT){
+        ret = connect_run(c, 0);
+    }
+    else if (c->closing){
+        ret = close_run(c, 0);
+    }
+    else if (c->state == ESTABLISHED && c->ring != NULL){
+        ret = snd_run(c, 0, 0);
+    }
+    if (ret == -1 && (errno == EINPROGRESS || errno == EAGAIN)){
+        return 0;
+    }
+    if (ret < 0){
+        errno = ETIMEDOUT;
+        return -1;
     }
     return 0;
 }
 
-ssize_t maybe_sendto(int s, const void *buf, size_t len, int flags, \
-                     const struct sockaddr *to, socklen_t tolen){
-
-	char *buffer = malloc(len);
-	memcpy(buffer, buf, len);
-	
-	
-	/*----- Packet not lost -----*/
-	if (rand() > LOSS_PROB*RAND_MAX){
-		/*----- Packet corrupted -----*/
-		if (rand() < CORR_PROB*RAND_MAX){
-			
-			/*----- Selecting a random byte inside the packet -----*/
-			int index = (int)((len-1)*rand()/(RAND_MAX + 1.0));
-
-			/*----- Inverting a bit -----*/
-			char c = buffer[index];
-			if (c & 0x01)
-				c &= 0xFE;
-			else
-				c |= 0x01;
-			buffer[index] = c;
-		}
-
-		/*----- Sending the packet -----*/
-		int retval = sendto(s, buffer, len, flags, to, tolen);
-		free(buffer);
-		return retval;
-	}
-	/*----- Packet lost -----*/
-	else
-		return(len);  /* Simulate a success */
+/* replaces the emulated network the socket sends through, spec as in */
+/* impair.h, NULL or "off" for the real one. -1 with EINVAL on a bad spec */
+int gbn_impair(int sockfd, const char* spec){
+    state_t* c = handle_get(sockfd);
+    struct gbn_sock* sk;
+    struct impair* im;
+    if (c == NULL){
+        return -1;
+    }
+    if (impair_new(spec, &im) < 0){
+        DBG_ERROR("Bad impairment");
+        return -1;
+    }
+    sk = c->sock;
+    pthread_mutex_lock(&sk->lock);
+    impair_drain(sk->imp);
+    impair_free(sk->imp);
+    sk->imp = im;
+    pthread_mutex_unlock(&sk->lock);
+    return 0;
 }
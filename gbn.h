@@ -14,17 +14,58 @@
 #include<errno.h>
 #include<netdb.h>
 #include<time.h>
+#include<pthread.h>
+#include<netinet/udp.h>
+#include "cc.h"
+#include "impair.h"
 
 /*----- Error variables -----*/
 extern int h_errno;
 extern int errno;
 
 /*----- Protocol parameters -----*/
-#define LOSS_PROB 1e-2    /* loss probability                            */
-#define CORR_PROB 1e-3    /* corruption probability                      */
-#define DATALEN   1024    /* length of the payload                       */
-#define N          256    /* Max number of packets a single call to gbn_send can process */
+#define IMPAIR_DEFAULT "loss=0.01,corrupt=0.001" /* impairment of a socket */
+                          /* when GBN_IMPAIR isn't set, see impair.h     */
+#define DATALEN   1024    /* default payload of DATA packets, and the    */
+                          /* payload of a peer that doesn't negotiate one */
+#define MINDATALEN  64    /* bounds of GBN_PAYLOAD, the largest is what  */
+#define MAXDATALEN 65499  /* fits a UDP datagram over IPv4               */
+#define SYNOPTLEN    2    /* payload of SYN and SYNACK: the largest DATA */
+                          /* payload their sender takes                  */
+#define HDRLEN       8    /* length of the header on the wire            */
+#define N          256    /* Number of packets the sender reads per call to gbn_send */
+#define WINSIZE    256    /* default sender window (in packets)          */
+#define MAXWIN   65536    /* largest window accepted by gbn_setsockopt   */
 #define TIMEOUT      1    /* timeout to resend packets (1 second)        */
+#define RTO_INIT  (TIMEOUT * 1000000) /* rto before the first RTT sample (usec) */
+#define RTO_MIN   1000    /* default lower bound of the rto (usec)       */
+#define RTO_MAX   2000000 /* default upper bound of the rto (usec)       */
+#define RCVBUF  (DATALEN * N) /* default per-connection receive buffer (bytes) */
+#define SNDBUF  (4 * DATALEN * N) /* default send buffer of a client (bytes) */
+#define MAPLEN  (16 << 20) /* bytes of a file gbn_sendfile maps at a time */
+#define BACKLOG     64    /* default limit of connections waiting for gbn_accept */
+#define REORDER    256    /* packets a Selective Repeat receiver keeps   */
+                          /* ahead of a hole, a power of 2               */
+#define ACK_EVERY    2    /* in-order packets per ACK                    */
+#define ACK_DELAY  500    /* longest an ACK is held back (usec)          */
+#define DUP_THRESH   3    /* duplicate ACKs that trigger a fast retransmit */
+#define FEC_K       16    /* first block of GBN_FEC_AUTO, in DATA packets */
+#define FEC_MAXK    32    /* bounds of a block, the receiver keeps up to */
+#define FEC_MINK     2    /* FEC_MAXK - 1 packets past its hole          */
+#define FECHDR       4    /* PARITY payload ahead of the XOR: the block  */
+                          /* size and the XOR of the DATA lengths        */
+#define MAXHANDLES (1 << 20) /* handles are fds, so they stay below this  */
+#define BATCH       64    /* datagrams per sendmmsg/recvmmsg call        */
+#define GSOSEGS     64    /* segments the kernel takes per GSO send      */
+#define GROLEN   65536    /* largest datagram GRO can hand us            */
+#define GROBATCH    16    /* datagrams per recvmmsg call when GRO is on  */
+#define CTRLLEN  (CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint64_t)))
+                          /* room for a UDP_SEGMENT or UDP_GRO cmsg and */
+                          /* an SCM_TXTIME one                          */
+#define PACE_SLACK  200000 /* catching up a late pacer may burst (nsec)  */
+#define PACE_HORIZON 2000000 /* SO_TXTIME stamps at most this far ahead (nsec) */
+#define PACE_GAIN_SS   2.0 /* pacing rate over cwnd/srtt in slow start   */
+#define PACE_GAIN     1.25 /* and after it                               */
 
 /*----- Packet types -----*/
 #define SYN      0        /* Opens a connection                          */
@@ -34,23 +75,280 @@ extern int errno;
 #define FIN      4        /* Ends a connection                           */
 #define FINACK   5        /* Acknowledgement of the FIN packet           */
 #define RST      6        /* Reset packet used to reject new connections */
+#define PARITY   7        /* XOR of a block of DATA packets, GBN_F_FEC   */
+
+/*----- Events returned by the internal event loop -----*/
+#define EV_READ  1        /* the socket has packets queued               */
+#define EV_TIMER 2        /* the deadline passed                         */
+
+/*----- Socket options (gbn_setsockopt) -----*/
+#define GBN_WINDOW 1      /* sender window in packets (int)              */
+#define GBN_RTO_MIN 2     /* lower bound of the rto in usec (int)        */
+#define GBN_RTO_MAX 3     /* upper bound of the rto in usec (int)        */
+#define GBN_RCVBUF  4     /* receive buffer of a connection in bytes (int) */
+#define GBN_REUSEPORT 5   /* share the port with other sockets (int), set before gbn_bind */
+#define GBN_CPU     6     /* CPU whose packets this socket prefers (int), SO_INCOMING_CPU */
+#define GBN_GSO     7     /* send window bursts with UDP GSO (int)       */
+#define GBN_GRO     8     /* receive GRO-coalesced datagrams (int), set before any traffic */
+#define GBN_CRC32C  9     /* ask for CRC32C checksums (int), set before gbn_connect */
+#define GBN_SACK   10     /* ask for Selective Repeat (int), set before gbn_connect */
+#define GBN_ACK_EVERY 11  /* in-order packets per ACK (int), 1 ACKs each one */
+#define GBN_ACK_DELAY 12  /* longest an ACK is held back in usec (int)   */
+#define GBN_CC     13     /* congestion controller (int), GBN_CC_*       */
+#define GBN_PACING 14     /* how the sender paces its packets (int), GBN_PACE_* */
+#define GBN_PACE_RATE 15  /* fixed pacing rate in bytes/s (int), 0 follows */
+                          /* the congestion window                       */
+#define GBN_PAYLOAD 16    /* largest DATA payload to negotiate in bytes (int), */
+                          /* set before gbn_connect or gbn_listen        */
+#define GBN_PMTU   17     /* keep DATA packets within the path MTU (int), */
+                          /* set before gbn_connect                      */
+#define GBN_SNDBUF 18     /* send buffer in bytes (int), it holds at least a window */
+#define GBN_NONBLOCK 19   /* calls return EAGAIN instead of waiting (int), */
+                          /* see gbn_fd, gbn_poll and gbn_process_timers */
+#define GBN_DUPTHRESH 20  /* duplicate ACKs before the sender resends    */
+                          /* without waiting for the timer (int), 0 never */
+#define GBN_FEC    21     /* DATA packets per PARITY packet (int), 0 none, */
+                          /* GBN_FEC_AUTO follows the losses; set it    */
+                          /* before gbn_connect to ask for FEC, after to */
+                          /* change the ratio                            */
+#define GBN_FEC_AUTO (-1)
+
+/*----- Readiness of a handle, gbn_poll -----*/
+#define GBN_POLLIN   0x01 /* gbn_recv or gbn_accept has something        */
+#define GBN_POLLOUT  0x02 /* connected and gbn_send has room             */
+#define GBN_POLLERR  0x04 /* the peer stopped answering                  */
+#define GBN_POLLHUP  0x08 /* the FIN was answered, gbn_close returns     */
+
+/*----- Statistics of a connection, gbn_getstats -----*/
+/* plain counters, only touched by the thread that owns the connection */
+/* (or holds the listener's lock), so they can stay on all the time    */
+#define GBN_HIST     32   /* histogram buckets, bucket i counts values   */
+                          /* in [2^i, 2^(i+1)) usec, bucket 0 also 0    */
+
+struct gbn_stats {
+    uint64_t pkts_sent;       /* DATA packets sent, retransmissions too     */
+    uint64_t bytes_sent;      /* their payload bytes                        */
+    uint64_t pkts_recv;       /* DATA packets received, duplicates too      */
+    uint64_t bytes_recv;
+    uint64_t acks_sent;
+    uint64_t acks_recv;
+    uint64_t retransmits;     /* DATA packets sent again                    */
+    uint64_t timeouts;        /* expiries of the retransmission timer       */
+    uint64_t dup_acks;        /* ACKs that didn't slide the window          */
+    uint64_t fast_retransmits; /* losses repaired before the timer fired    */
+    uint64_t bad_checksum;    /* packets failing the checksum or too short  */
+    uint64_t ooo_drops;       /* DATA ahead of a hole that was dropped      */
+    uint64_t dup_drops;       /* DATA that was received before              */
+    uint64_t full_drops;      /* in-order DATA dropped for lack of room     */
+    uint64_t fec_sent;        /* PARITY packets sent                        */
+    uint64_t fec_recovered;   /* DATA packets rebuilt from a PARITY one     */
+    uint64_t rtt_hist[GBN_HIST]; /* RTT samples                             */
+    uint64_t ack_hist[GBN_HIST]; /* how long in-order DATA waited for its  */
+                              /* delayed ACK                                */
+};
+
+/*----- Congestion controllers, see cc.c -----*/
+#define GBN_CC_NONE  0    /* fixed window of GBN_WINDOW packets          */
+#define GBN_CC_RENO  1    /* slow start and AIMD                         */
+#define GBN_CC_CUBIC 2    /* CUBIC, the default                          */
+
+/*----- Pacing modes -----*/
+#define GBN_PACE_OFF    0 /* whole window bursts back to back            */
+#define GBN_PACE_USER   1 /* the sender waits on its timer between packets, the default */
+#define GBN_PACE_TXTIME 2 /* packets carry their departure time (SO_TXTIME) */
+                          /* and the fq qdisc holds them                 */
+
+/*----- Header flags -----*/
+#define GBN_F_CRC32C 0x01 /* checksum is a CRC32C; on a SYN it asks for */
+                          /* CRC32C, on the SYNACK it agrees            */
+#define GBN_F_SACK   0x02 /* Selective Repeat, negotiated the same way;  */
+                          /* ACKs then carry a SACK bitmap              */
+#define GBN_F_FEC    0x04 /* PARITY packets follow the DATA, negotiated */
+                          /* the same way, Go-Back-N only                */
+#define GBN_F_BLOCK  0x08 /* on DATA: the first packet of a FEC block   */
 
 /*----- Go-Back-n packet format -----*/
+/* the first HDRLEN bytes of a datagram, in network byte order, are */
+/* type, flags, checksum and seqnum; the payload follows. The payload is */
+/* never copied into the header: data points at the caller's buffer when */
+/* sending and into the received datagram when receiving */
 typedef struct {
 	uint8_t  type;            /* packet type (e.g. SYN, DATA, ACK, FIN)     */
-	uint8_t  seqnum;          /* sequence number of the packet              */
+	uint8_t  flags;           /* GBN_F_* bits                               */
     uint16_t checksum;        /* header and payload checksum                */
-    uint8_t data[DATALEN];    /* pointer to the payload                     */
-} __attribute__((packed)) gbnhdr;
+	uint32_t seqnum;          /* sequence number of the packet              */
+    const uint8_t* data;      /* pointer to the payload                     */
+    int len;                  /* payload length                             */
+} gbnhdr;
+
+/*----- Sequence number comparison, safe across wrap-around -----*/
+#define SEQ_LT(a, b)  ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+
+/* descriptor of one in-flight packet, points into the caller's buffer */
+struct packet {
+    const char* start_addr;
+    int length;
+    uint32_t seqnum;
+    uint64_t sent;            /* time of the last transmission (usec)       */
+    int transmissions;        /* times sent, RTT is sampled only if 1 (Karn) */
+    uint16_t checksum;        /* computed on the first transmission         */
+    int sacked;               /* the receiver holds it (Selective Repeat)   */
+    uint8_t block;            /* GBN_F_BLOCK if it starts a FEC block       */
+};
 
+/* part of a file mapped by gbn_sendfile, its packets point into it */
+struct gbn_map {
+    char* addr;
+    size_t len;
+    uint32_t last;            /* sequence number of its last packet         */
+    struct gbn_map* next;
+};
+
+/* a packet received ahead of a hole, Selective Repeat only */
+struct held {
+    uint32_t seqnum;
+    int len;                  /* payload length, -1 if the slot is free     */
+    char* data;               /* room for the connection's payload          */
+};
+
+struct gbn_sock;
+
+/* datagrams queued for one sendmmsg or filled by one recvmmsg */
+struct gbn_batch {
+    struct mmsghdr msgs[BATCH];
+    struct iovec iovs[BATCH][2]; /* header and payload of a queued packet,  */
+                              /* the receive slot of a received one         */
+    struct sockaddr_storage addrs[BATCH];
+    char hdrs[BATCH][HDRLEN]; /* headers of queued packets                  */
+    char ctrl[BATCH][CTRLLEN];
+    char* bufs[BATCH];        /* receive slots, on tx the copies of packets */
+                              /* the loss emulation corrupts                */
+    size_t bufsize;           /* size of every slot                         */
+    int cap;                  /* slots in use, at most BATCH                */
+    int n;                    /* messages queued (tx) or received (rx)      */
+    uint64_t when[BATCH];     /* SO_TXTIME departure of queued packets      */
+                              /* (nsec), 0 sends right away                 */
+    struct mmsghdr gso_msgs[BATCH]; /* runs of packets coalesced for GSO    */
+    struct iovec gso_iovs[2 * BATCH];
+    char gso_ctrl[BATCH][CTRLLEN];
+};
+
+/* state of one connection, a listening socket keeps one per peer */
 typedef struct state_t{
 	int state;
-    uint8_t ex_seqnum;
-    uint8_t winsize;
-    struct sockaddr addr;
+    uint8_t flags;            /* header flags of our packets, GBN_F_CRC32C, */
+                              /* GBN_F_SACK and GBN_F_FEC once both sides   */
+                              /* agreed                                     */
+    uint32_t ex_seqnum;       /* next sequence number to send or to expect  */
+    uint32_t payload;         /* largest DATA payload, GBN_PAYLOAD until    */
+                              /* the handshake lowers it to the peer's      */
+    int pmtu;                 /* lower payload to the path MTU on connect   */
+    uint32_t winsize;         /* sender window in packets, the most the     */
+                              /* congestion window may open to              */
+    struct cc_state cc;       /* congestion control of the sender           */
+    int pacing;               /* GBN_PACE_* mode of the sender              */
+    uint32_t pace_rate;       /* fixed pacing rate (bytes/s), 0 for cwnd/srtt */
+    uint64_t pace_next;       /* when the next packet may leave (nsec)      */
+    struct packet* ring;      /* ring buffer of buffered and in-flight packets, */
+                              /* ex_seqnum is the next one to fill          */
+    uint32_t ring_mask;       /* ring capacity - 1, capacity is a power of 2 */
+    char* sbuf;               /* payload bytes of every ring slot           */
+    struct gbn_map* maps;     /* mappings with un-ACK'd packets, oldest     */
+    struct gbn_map* maps_tail; /* first                                     */
+    uint32_t sndbuf;          /* size of the send buffer asked for (bytes)  */
+    uint32_t snd_base;        /* oldest un-ACK'd packet                     */
+    uint32_t snd_next;        /* next packet to send                        */
+    uint32_t snd_high;        /* one past the highest packet sent           */
+    uint32_t snd_recover;     /* the window is cut once per loss episode,   */
+    int snd_recovering;       /* which ends once snd_recover is ACK'd       */
+    uint32_t snd_goback;      /* base Go-Back-N last went back to, the end  */
+    uint32_t snd_goback_high; /* of what it resends and when (usec): the    */
+    uint64_t snd_goback_at;   /* duplicates re-arm once either is past      */
+    int snd_attempts;         /* timeouts in a row without progress         */
+    uint32_t dup_thresh;      /* duplicate ACKs that trigger a fast         */
+    uint32_t dup_count;       /* retransmit, and those seen since the last  */
+                              /* ACK that slid the window                   */
+    int fec_k;                /* DATA packets per PARITY packet, 0 none     */
+    int fec_auto;             /* fec_k follows the losses, GBN_FEC_AUTO     */
+    int fec_clean;            /* no loss since the last block was closed    */
+    int fec_open;             /* receiver: a block is being collected       */
+    uint32_t fec_start;       /* first packet of the current block          */
+    uint32_t fec_n;           /* its packets XOR'd into fec_parity so far   */
+    uint16_t fec_len;         /* XOR of their lengths                       */
+    uint16_t fec_max;         /* the longest of them, sender only           */
+    uint8_t* fec_parity;      /* XOR of their payloads, payload bytes       */
+    struct held* fec_held;    /* receiver: FEC_MAXK - 1 packets past the    */
+    uint32_t fec_nheld;       /* hole of the block, slot i is ex_seqnum+1+i */
+    uint64_t snd_due;         /* next timer of a non-blocking sender (usec), */
+                              /* 0 if there is none                         */
+    uint64_t hs_sent;         /* when the SYN or FIN went out (usec)        */
+    int hs_attempts;          /* times it was resent without an answer      */
+    int closing;              /* gbn_close started, non-blocking            */
+    uint32_t srtt;            /* smoothed RTT (usec), 0 until first sample  */
+    uint32_t rttvar;          /* RTT variance (usec)                        */
+    uint32_t rto;             /* current retransmission timeout (usec)      */
+    uint32_t rto_min;         /* bounds of the rto (usec)                   */
+    uint32_t rto_max;
+    char* rbuf;               /* in-order data not yet read by gbn_recv     */
+    size_t roff;              /* offset of the first unread byte in rbuf    */
+    size_t rlen;              /* number of unread bytes in rbuf             */
+    size_t rcap;              /* capacity of rbuf                           */
+    struct held* held;        /* REORDER slots indexed by seqnum, SR only,  */
+                              /* with payload bytes of data each            */
+    uint32_t nheld;           /* slots in use                               */
+    uint32_t ack_every;       /* in-order packets per ACK                   */
+    uint32_t ack_delay;       /* longest an ACK is held back (usec)         */
+    uint32_t unacked;         /* in-order packets not ACK'd yet             */
+    uint64_t ack_due;         /* when the delayed ACK goes out (usec)       */
+    uint64_t ack_first;       /* when the oldest un-ACK'd packet came (usec) */
+    int ack_queued;           /* on the socket's delayed ACK list           */
+    struct state_t* anext;    /* next connection on that list               */
+    const struct iovec* uiov; /* buffers of a gbn_recvv waiting with rbuf  */
+    int uidx;                 /* empty, in-order data goes straight there,  */
+    size_t uoff;              /* at offset uoff of uiov[uidx]               */
+    size_t ucap;              /* bytes the buffers hold                     */
+    size_t ulen;              /* bytes already in them                      */
+    struct gbn_sock* sock;    /* UDP socket carrying the connection         */
+    struct state_t* hnext;    /* next connection in the same hash bucket    */
+    struct state_t* qnext;    /* next connection waiting for gbn_accept     */
+    struct gbn_stats stats;
+    struct sockaddr_storage addr;
     socklen_t len;
 } state_t;
 
+/* one UDP socket and its event loop */
+struct gbn_sock {
+    int fd;                   /* the UDP socket                             */
+    int epfd;                 /* epoll set of the socket and the timer      */
+    int tfd;                  /* timerfd for retransmission deadlines       */
+    state_t* conn;            /* the connection of a client socket, the     */
+                              /* template for new connections of a listener */
+    int listening;            /* set by gbn_listen                          */
+    int backlog;              /* limit of connections in the accept queue   */
+    int refs;                 /* handles still pointing at the socket       */
+    state_t** table;          /* hash of connections keyed by peer address  */
+    uint32_t table_mask;      /* buckets - 1, buckets is a power of 2       */
+    uint32_t nconns;          /* connections in the table                   */
+    state_t* accept_head;     /* established connections not yet accepted   */
+    state_t* accept_tail;
+    int naccept;
+    state_t* ack_head;        /* connections with a delayed ACK, oldest     */
+    state_t* ack_tail;        /* first                                      */
+    struct gbn_batch* tx;     /* outgoing datagrams not yet flushed         */
+    struct gbn_batch* rx;     /* datagrams of the last recvmmsg             */
+    uint32_t maxdata;         /* largest payload the batches' slots hold    */
+    int gso;                  /* kernel segments our bursts (UDP_SEGMENT)   */
+    int gro;                  /* kernel coalesces what we receive (UDP_GRO) */
+    int txtime;               /* SO_TXTIME is on, packets carry their departure */
+    int pumping;              /* a thread is reading the socket             */
+    int nonblock;             /* GBN_NONBLOCK, calls never wait             */
+    uint64_t due;             /* deadline the timer was last armed for      */
+    struct impair* imp;       /* emulated network on the way out, or NULL   */
+    pthread_mutex_t lock;     /* guards everything above on a listener      */
+    pthread_cond_t cond;      /* signaled after every batch of packets      */
+};
+
 enum {
 	CLOSED=0,
 	SYN_SENT,
@@ -60,8 +358,6 @@ enum {
 	FIN_RCVD
 };
 
-extern state_t s;
-
 void gbn_init();
 int gbn_connect(int sockfd, const struct sockaddr *server, socklen_t socklen);
 int gbn_listen(int sockfd, int backlog);
@@ -70,10 +366,15 @@ int gbn_socket(int domain, int type, int protocol);
 int gbn_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 int gbn_close(int sockfd);
 ssize_t gbn_send(int sockfd, const void *buf, size_t len, int flags);
+ssize_t gbn_sendfile(int sockfd, int fd, off_t offset, size_t count);
 ssize_t gbn_recv(int sockfd, void *buf, size_t len, int flags);
-
-ssize_t  maybe_sendto(int  s, const void *buf, size_t len, int flags, \
-                      const struct sockaddr *to, socklen_t tolen);
+ssize_t gbn_recvv(int sockfd, const struct iovec *iov, int iovcnt, int flags);
+int gbn_setsockopt(int sockfd, int optname, const void *optval, socklen_t optlen);
+int gbn_fd(int sockfd);
+int gbn_poll(int sockfd);
+int gbn_process_timers(int sockfd);
+int gbn_impair(int sockfd, const char* spec);
+int gbn_getstats(int sockfd, struct gbn_stats* st);
 
 uint16_t checksum(uint16_t *buf, int nwords);
 
@@ -1,84 +1,40 @@
 #include <stdio.h>
-#include <time.h>
-#include <stdarg.h>
 #include <string.h>
 #include "helper.h"
-
-#define LOG_FNAME "send_dbg.txt"
-#define LOG_FNAME2 "recv_dbg.txt"
-
-static int access_count = 0;
-char module_name[200];
-
-void get_current_time(char (*time_str)[], size_t maxsize) {
-
-    time_t t;
-    struct tm* timeinfo;
-
-    time(&t);
-    timeinfo = gmtime(&t);
-    strftime(*time_str, maxsize, "%a, %d %b %Y %X %Z", timeinfo);
-}
+#include "gbn.h"
+#include "checksum.h"
 
 int itoa(char* buf, int number){
     return sprintf(buf, "%d", number);
 }
 
-void dbg_log_print(char* fname, int lnum, char* fmt, ...) {
-
-    FILE* log_fd;
-    char time_str[255];
-    char* pfmt;
-    char* sparam;
-    int iparam;
-    va_list list;
-
-    if (strncmp(module_name, "./s", 3) == 0){
-        if (access_count == 0) {
-            log_fd = fopen(LOG_FNAME, "w");
-        }
-        else {
-            log_fd = fopen(LOG_FNAME, "a+");
+static void print_hist(FILE* f, const char* who, const char* name, const uint64_t* hist){
+    int i;
+    fprintf(f, "stats: %s %s_usec", who, name);
+    for (i = 0; i < GBN_HIST; i++) {
+        if (hist[i] != 0) {
+            fprintf(f, " %llu=%llu", i == 0 ? 0ULL : 1ULL << i, (unsigned long long)hist[i]);
         }
     }
-    else{
-        if (access_count == 0) {
-            log_fd = fopen(LOG_FNAME2, "w");
-        }
-        else {
-            log_fd = fopen(LOG_FNAME2, "a+");
-        }
-    }
-
-
-    get_current_time(&time_str, sizeof(time_str));
-    fprintf(log_fd, "%s %s %d>", time_str, fname, lnum );
-
-    va_start(list, fmt);
-    for (pfmt = fmt; *pfmt != '\0'; pfmt++) {
-        if (*pfmt != '%') {
-            fputc(*pfmt, log_fd);
-        }
-        else {
-            switch (*(++pfmt)) {
-
-                case 's':
-                    sparam = va_arg(list, char *);
-                    fprintf(log_fd, "%s", sparam);
-                    break;
-                case 'd':
-                    iparam = va_arg(list, int);
-                    fprintf(log_fd, "%d", iparam);
-                    break;
-                default:
-                    fputc(*pfmt, log_fd);
-            }
-        }
-    }
-    va_end(list);
-
-    fputc('\n', log_fd);
-    access_count++;
-    fclose(log_fd);
+    fputc('\n', f);
 }
 
+void print_stats(FILE* f, const char* who, const struct gbn_stats* st) {
+
+    fprintf(f, "stats: %s pkts_sent=%llu bytes_sent=%llu pkts_recv=%llu bytes_recv=%llu "
+            "acks_sent=%llu acks_recv=%llu retransmits=%llu timeouts=%llu dup_acks=%llu "
+            "fast_retransmits=%llu bad_checksum=%llu ooo_drops=%llu dup_drops=%llu full_drops=%llu "
+            "fec_sent=%llu fec_recovered=%llu\n", who,
+            (unsigned long long)st->pkts_sent, (unsigned long long)st->bytes_sent,
+            (unsigned long long)st->pkts_recv, (unsigned long long)st->bytes_recv,
+            (unsigned long long)st->acks_sent, (unsigned long long)st->acks_recv,
+            (unsigned long long)st->retransmits, (unsigned long long)st->timeouts,
+            (unsigned long long)st->dup_acks, (unsigned long long)st->fast_retransmits,
+            (unsigned long long)st->bad_checksum,
+            (unsigned long long)st->ooo_drops, (unsigned long long)st->dup_drops,
+            (unsigned long long)st->full_drops,
+            (unsigned long long)st->fec_sent, (unsigned long long)st->fec_recovered);
+    print_hist(f, who, "rtt", st->rtt_hist);
+    print_hist(f, who, "ack_delay", st->ack_hist);
+    fprintf(f, "stats: %s kernels csum=%s crc32c=%s\n", who, csum_impl(), crc32c_impl());
+}
@@ -2,23 +2,28 @@
 #define GBN_HELPER_H
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include "trace.h"
 
 #define STR_ERROR() \
     (errno == 0 ? "None" : strerror(errno))
 #define ERR_CHECK(A, M, ...) \
     if (!(A)) {DBG_ERROR(M, ##__VA_ARGS__); errno = 0; goto error_exit;}
 #define DBG_ERROR(M, ...) \
-    dbg_log_print(__FILE__, __LINE__, "[ERROR]: %s. " M, STR_ERROR(), ##__VA_ARGS__)
-#define DBG_PRINT(...) \
-    /*dbg_log_print(__FILE__, __LINE__, ##__VA_ARGS__)*/
-
-extern char module_name[200];
-
-void get_current_time(char (*time_str)[], size_t maxsize);
+    TRACE_MSG(TRACE_ERROR, __FILE__ ":" LINE_STR(__LINE__) "> [ERROR]: %s. " M, ##__VA_ARGS__)
+#define DBG_PRINT(M, ...) \
+    TRACE_MSG(TRACE_DEBUG, __FILE__ ":" LINE_STR(__LINE__) "> " M, ##__VA_ARGS__)
+#define LINE_STR(L) LINE_STR_(L)
+#define LINE_STR_(L) #L
 
 int itoa(char* buf, int number);
 
-void dbg_log_print(char* fname, int lnum, char* fmt, ...);
+struct gbn_stats;
+
+/* writes the counters of st on a line, the nonempty histogram buckets */
+/* and the checksum kernels in use on one line each, every line starting */
+/* with "stats: who" */
+void print_stats(FILE* f, const char* who, const struct gbn_stats* st);
 
 #endif
@@ -0,0 +1,411 @@
+#include "impair.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define IMPAIR_LIMIT 1000     /* datagrams held by default                   */
+
+/* a datagram held until it is due, sorted by due time */
+struct held_dgram {
+    uint64_t at;              /* when it goes out (usec)                     */
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    size_t len;
+    struct held_dgram* next;
+    char data[1];
+};
+
+struct impair {
+    double loss;
+    double ge_p, ge_r;        /* Gilbert-Elliott transition probabilities   */
+    double ge_bad, ge_good;   /* and loss probabilities per state           */
+    int bad;                  /* the chain is in the bad state              */
+    double corrupt;
+    double dup;
+    double reorder;
+    uint64_t delay;           /* usec                                       */
+    uint64_t jitter;
+    double rate;              /* bytes/s, 0 for no limit                    */
+    uint64_t link_free;       /* when the link is done with what it took    */
+    int limit;
+    uint64_t rng;             /* xorshift64* state                          */
+    struct held_dgram* head;
+    struct held_dgram* tail;
+    int held;
+    int stats;                /* report the counters below when done       */
+    unsigned long sent;       /* datagrams handed to the emulator          */
+    unsigned long bytes;
+    unsigned long lost;       /* lost, corrupted, ... on the way           */
+    unsigned long corrupted;
+    unsigned long duplicated;
+    unsigned long delayed;
+    unsigned long overflows;  /* dropped because the emulator was full     */
+    pthread_mutex_t lock;     /* connections of a listener share the socket */
+    struct impair* next;      /* all emulators of the process               */
+};
+
+static struct impair* all = NULL;
+static pthread_mutex_t all_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t all_once = PTHREAD_ONCE_INIT;
+
+static uint64_t now_usec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* uniform in [0, 1) */
+static double rnd(struct impair* im){
+    im->rng ^= im->rng >> 12;
+    im->rng ^= im->rng << 25;
+    im->rng ^= im->rng >> 27;
+    return ((im->rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* splitmix64 spreads any seed, 0 included, over the whole state */
+static void seed(struct impair* im, uint64_t s){
+    s += 0x9e3779b97f4a7c15ULL;
+    s = (s ^ (s >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    s = (s ^ (s >> 27)) * 0x94d049bb133111ebULL;
+    im->rng = (s ^ (s >> 31)) | 1;
+}
+
+/* one line per emulator on stderr, for scripts like bench.sh */
+static void report(struct impair* im){
+    if (im->stats){
+        fprintf(stderr, "impair: pid %d sent %lu bytes %lu lost %lu corrupted %lu duplicated %lu "
+                "delayed %lu overflows %lu\n", (int)getpid(), im->sent, im->bytes, im->lost,
+                im->corrupted, im->duplicated, im->delayed, im->overflows);
+    }
+}
+
+/* what is on the wire is still delivered when the process exits */
+static void drain_all(void){
+    struct impair* im;
+    pthread_mutex_lock(&all_lock);
+    for (im = all; im != NULL; im = im->next){
+        impair_drain(im);
+        report(im);
+    }
+    pthread_mutex_unlock(&all_lock);
+}
+
+static void register_exit(void){
+    atexit(drain_all);
+}
+
+/*----- Parsing the spec -----*/
+static int parse_prob(const char* v, double* p){
+    char* end;
+    *p = strtod(v, &end);
+    return *end == '\0' && end != v && *p >= 0 && *p <= 1 ? 0 : -1;
+}
+
+static int parse_time(const char* v, uint64_t* t){
+    char* end;
+    double d = strtod(v, &end);
+    if (end == v || d < 0){
+        return -1;
+    }
+    if (strcmp(end, "s") == 0){
+        d *= 1e6;
+    }
+    else if (strcmp(end, "ms") == 0){
+        d *= 1e3;
+    }
+    else if (*end != '\0' && strcmp(end, "us") != 0){
+        return -1;
+    }
+    *t = (uint64_t)d;
+    return 0;
+}
+
+static int parse_rate(const char* v, double* r){
+    char* end;
+    *r = strtod(v, &end);
+    if (end == v || *r < 0){
+        return -1;
+    }
+    if (strcmp(end, "kbit") == 0){
+        *r *= 1e3 / 8;
+    }
+    else if (strcmp(end, "mbit") == 0){
+        *r *= 1e6 / 8;
+    }
+    else if (strcmp(end, "gbit") == 0){
+        *r *= 1e9 / 8;
+    }
+    else if (*end != '\0'){
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_pair(struct impair* im, const char* key, const char* v){
+    char* end;
+    if (strcmp(key, "loss") == 0)    return parse_prob(v, &im->loss);
+    if (strcmp(key, "ge_p") == 0)    return parse_prob(v, &im->ge_p);
+    if (strcmp(key, "ge_r") == 0)    return parse_prob(v, &im->ge_r);
+    if (strcmp(key, "ge_bad") == 0)  return parse_prob(v, &im->ge_bad);
+    if (strcmp(key, "ge_good") == 0) return parse_prob(v, &im->ge_good);
+    if (strcmp(key, "corrupt") == 0) return parse_prob(v, &im->corrupt);
+    if (strcmp(key, "dup") == 0)     return parse_prob(v, &im->dup);
+    if (strcmp(key, "reorder") == 0) return parse_prob(v, &im->reorder);
+    if (strcmp(key, "delay") == 0)   return parse_time(v, &im->delay);
+    if (strcmp(key, "jitter") == 0)  return parse_time(v, &im->jitter);
+    if (strcmp(key, "rate") == 0)    return parse_rate(v, &im->rate);
+    if (strcmp(key, "limit") == 0){
+        im->limit = strtol(v, &end, 10);
+        return *end == '\0' && end != v && im->limit > 0 ? 0 : -1;
+    }
+    if (strcmp(key, "stats") == 0){
+        im->stats = strtol(v, &end, 10);
+        return *end == '\0' && end != v ? 0 : -1;
+    }
+    if (strcmp(key, "seed") == 0){
+        seed(im, strtoull(v, &end, 10));
+        return *end == '\0' && end != v ? 0 : -1;
+    }
+    return -1;
+}
+
+int impair_new(const char* spec, struct impair** out){
+    struct impair* im;
+    char* copy;
+    char* pair;
+    char* save;
+    char* v;
+
+    *out = NULL;
+    if (spec == NULL || *spec == '\0' || strcmp(spec, "off") == 0){
+        return 0;
+    }
+    if ((im = calloc(1, sizeof(struct impair))) == NULL){
+        return -1;
+    }
+    im->ge_bad = 1;
+    im->limit = IMPAIR_LIMIT;
+    seed(im, now_usec() ^ ((uint64_t)getpid() << 32) ^ (uintptr_t)im);
+    if ((copy = strdup(spec)) == NULL){
+        free(im);
+        return -1;
+    }
+    for (pair = strtok_r(copy, ",", &save); pair != NULL; pair = strtok_r(NULL, ",", &save)){
+        if ((v = strchr(pair, '=')) == NULL){
+            break;
+        }
+        *v++ = '\0';
+        if (parse_pair(im, pair, v) < 0){
+            break;
+        }
+    }
+    free(copy);
+    if (pair != NULL){
+        free(im);
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_init(&im->lock, NULL);
+    pthread_once(&all_once, register_exit);
+    pthread_mutex_lock(&all_lock);
+    im->next = all;
+    all = im;
+    pthread_mutex_unlock(&all_lock);
+    *out = im;
+    return 0;
+}
+
+void impair_free(struct impair* im){
+    struct held_dgram* h;
+    struct impair** pp;
+    if (im == NULL){
+        return;
+    }
+    pthread_mutex_lock(&all_lock);
+    for (pp = &all; *pp != im; pp = &(*pp)->next)
+        ;
+    *pp = im->next;
+    pthread_mutex_unlock(&all_lock);
+    report(im);
+    while ((h = im->head) != NULL){
+        im->head = h->next;
+        free(h);
+    }
+    pthread_mutex_destroy(&im->lock);
+    free(im);
+}
+
+/*----- The emulator -----*/
+static size_t msg_len(const struct msghdr* mh){
+    size_t i, len = 0;
+    for (i = 0; i < mh->msg_iovlen; i++){
+        len += mh->msg_iov[i].iov_len;
+    }
+    return len;
+}
+
+/* copies a message to be sent at time at, -1 if the emulator is full */
+static int hold(struct impair* im, int fd, const struct msghdr* mh, uint64_t at){
+    struct held_dgram* h;
+    struct held_dgram** pp;
+    size_t i, len = msg_len(mh);
+    if (im->held >= im->limit || (h = malloc(sizeof(struct held_dgram) + len)) == NULL){
+        return -1;
+    }
+    h->at = at;
+    h->fd = fd;
+    h->addrlen = mh->msg_namelen;
+    memcpy(&h->addr, mh->msg_name, mh->msg_namelen);
+    h->len = 0;
+    for (i = 0; i < mh->msg_iovlen; i++){
+        memcpy(h->data + h->len, mh->msg_iov[i].iov_base, mh->msg_iov[i].iov_len);
+        h->len += mh->msg_iov[i].iov_len;
+    }
+    /* mostly in order, so the place is found from the tail */
+    if (im->tail == NULL || im->tail->at <= at){
+        h->next = NULL;
+        if (im->tail != NULL){
+            im->tail->next = h;
+        }
+        else {
+            im->head = h;
+        }
+        im->tail = h;
+    }
+    else {
+        for (pp = &im->head; (*pp)->at <= at; pp = &(*pp)->next)
+            ;
+        h->next = *pp;
+        *pp = h;
+    }
+    im->held++;
+    return 0;
+}
+
+/* is the next datagram lost? */
+static int lost(struct impair* im){
+    int drop = 0;
+    if (im->ge_p > 0){
+        if (im->bad ? rnd(im) < im->ge_r : rnd(im) < im->ge_p){
+            im->bad = !im->bad;
+        }
+        drop = rnd(im) < (im->bad ? im->ge_bad : im->ge_good);
+    }
+    if (im->loss > 0 && rnd(im) < im->loss){
+        drop = 1;
+    }
+    return drop;
+}
+
+unsigned int impair_msgs(struct impair* im, int fd, struct mmsghdr* msgs, unsigned int n,
+                         char* scratch, size_t stride){
+    unsigned int i, kept = 0;
+    uint64_t now = now_usec(), at;
+    size_t len;
+    double j;
+
+    pthread_mutex_lock(&im->lock);
+    for (i = 0; i < n; i++){
+        struct msghdr* mh = &msgs[i].msg_hdr;
+        len = msg_len(mh);
+        im->sent++;
+        im->bytes += len;
+        if (lost(im)){
+            im->lost++;
+            continue;
+        }
+        if (im->corrupt > 0 && rnd(im) < im->corrupt && len > 0){
+            char* buffer = scratch + i * stride;
+            size_t k, off = 0;
+            for (k = 0; k < mh->msg_iovlen; k++){
+                /* a payload may already sit in its slot, behind the header */
+                memmove(buffer + off, mh->msg_iov[k].iov_base, mh->msg_iov[k].iov_len);
+                off += mh->msg_iov[k].iov_len;
+            }
+            mh->msg_iov[0].iov_base = buffer;
+            mh->msg_iov[0].iov_len = len;
+            mh->msg_iovlen = 1;
+            buffer[(size_t)(rnd(im) * len)] ^= 0x01;
+            im->corrupted++;
+        }
+        /* the link takes one datagram after the other at its rate, */
+        /* then the delay starts */
+        at = now;
+        if (im->rate > 0){
+            if (im->held >= im->limit){
+                im->overflows++;
+                continue;
+            }
+            im->link_free = (im->link_free > now ? im->link_free : now) + (uint64_t)(len * 1e6 / im->rate);
+            at = im->link_free;
+        }
+        if (im->reorder == 0 || rnd(im) >= im->reorder){
+            at += im->delay;
+            if (im->jitter > 0){
+                j = (2 * rnd(im) - 1) * im->jitter;
+                at = j < 0 && (uint64_t)-j > at - now ? now : at + (int64_t)j;
+            }
+        }
+        if (im->dup > 0 && rnd(im) < im->dup && hold(im, fd, mh, at) == 0){
+            im->duplicated++;
+        }
+        if (at > now){
+            /* a full emulator drops like a full queue */
+            if (hold(im, fd, mh, at) < 0){
+                im->overflows++;
+            }
+            else {
+                im->delayed++;
+            }
+            continue;
+        }
+        msgs[kept++] = msgs[i];
+    }
+    pthread_mutex_unlock(&im->lock);
+    return kept;
+}
+
+uint64_t impair_release(struct impair* im){
+    struct held_dgram* h;
+    uint64_t now = now_usec(), next;
+    pthread_mutex_lock(&im->lock);
+    while ((h = im->head) != NULL && h->at <= now){
+        /* like the link, the emulator doesn't care whether it arrives */
+        sendto(h->fd, h->data, h->len, MSG_DONTWAIT, (struct sockaddr*)&h->addr, h->addrlen);
+        im->head = h->next;
+        if (im->head == NULL){
+            im->tail = NULL;
+        }
+        im->held--;
+        free(h);
+    }
+    next = im->head != NULL ? im->head->at : 0;
+    pthread_mutex_unlock(&im->lock);
+    return next;
+}
+
+void impair_drain(struct impair* im){
+    struct timespec ts;
+    uint64_t next;
+    if (im == NULL){
+        return;
+    }
+    while ((next = impair_release(im)) != 0){
+        ts.tv_sec = next / 1000000;
+        ts.tv_nsec = (next % 1000000) * 1000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+}
+
+uint64_t impair_next(struct impair* im){
+    uint64_t next;
+    pthread_mutex_lock(&im->lock);
+    next = im->head != NULL ? im->head->at : 0;
+    pthread_mutex_unlock(&im->lock);
+    return next;
+}
@@ -0,0 +1,55 @@
+#ifndef GBN_IMPAIR_H
+#define GBN_IMPAIR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*----- Network impairment emulator -----*/
+/* stands between a socket and the network on the way out: loses, corrupts, */
+/* duplicates, delays, rate limits and reorders datagrams. Configured by a  */
+/* spec of comma separated key=value pairs, "off" or "" for none:           */
+/*   loss=P        independent loss probability                             */
+/*   ge_p=P        Gilbert-Elliott burst loss: good to bad probability,     */
+/*   ge_r=P        bad to good probability,                                 */
+/*   ge_bad=P      loss probability in the bad state (1),                   */
+/*   ge_good=P     and in the good state (0)                                */
+/*   corrupt=P     one bit of the datagram flipped                          */
+/*   dup=P         the datagram sent twice                                  */
+/*   delay=T       one way delay, and jitter=T spread uniformly around it   */
+/*   reorder=P     the datagram skips the delay, overtaking others (netem)  */
+/*   rate=R        link rate in bytes/s, or with kbit, mbit, gbit           */
+/*   limit=N       datagrams the emulator holds at most (1000), tail drop   */
+/*   seed=N        seed of the random numbers, so runs can be repeated      */
+/*   stats=1       counters of what happened on stderr when it's freed or   */
+/*                 the process exits                                        */
+/* times are in usec, or with us, ms, s. An emulator may be shared between  */
+/* threads                                                                  */
+
+struct impair;
+
+/* emulator for spec in *im, NULL if spec turns it off. -1 with EINVAL on */
+/* a bad spec */
+int impair_new(const char* spec, struct impair** im);
+void impair_free(struct impair* im);
+
+/* runs the n messages about to be sent on fd through the emulator. Those */
+/* to be sent now are moved to the front of msgs and counted in the result, */
+/* the others are copied and held until impair_release(). A corrupted */
+/* message i is gathered into scratch + i * stride and flipped there, the */
+/* caller's data is never written */
+unsigned int impair_msgs(struct impair* im, int fd, struct mmsghdr* msgs, unsigned int n,
+                         char* scratch, size_t stride);
+
+/* sends the held datagrams that are due. Returns when the next one is */
+/* (usec, monotonic clock), 0 if none is held */
+uint64_t impair_release(struct impair* im);
+
+/* waits until every held datagram is sent, the network still delivers */
+/* what is in flight when a socket goes away */
+void impair_drain(struct impair* im);
+
+/* when the next held datagram is due, 0 if none is held */
+uint64_t impair_next(struct impair* im);
+
+#endif
@@ -0,0 +1,216 @@
+#include "impair.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define h_addr h_addr_list[0]
+
+#define MAXCLIENTS 64        /* senders the proxy relays for at a time      */
+#define DGRAM 65536          /* largest datagram relayed                    */
+
+/* a sender, with its own socket towards the receiver so the answers can */
+/* be told apart */
+struct client {
+	struct sockaddr_in addr;
+	int fd;
+};
+
+static struct client clients[MAXCLIENTS];
+static int nclients = 0;
+static char buf[DGRAM];
+static char scratch[DGRAM];
+
+/*----- The client of a sender, new ones join the event loop -----*/
+static struct client *client_of(struct sockaddr_in *from, int epfd)
+{
+	struct epoll_event ev;
+	int i;
+
+	for (i = 0; i < nclients; i++){
+		if (clients[i].addr.sin_port == from->sin_port &&
+		    clients[i].addr.sin_addr.s_addr == from->sin_addr.s_addr)
+			return &clients[i];
+	}
+	if (nclients == MAXCLIENTS){
+		fprintf(stderr, "proxy: too many senders, dropping\n");
+		return NULL;
+	}
+	if ((clients[i].fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1){
+		perror("socket");
+		exit(-1);
+	}
+	clients[i].addr = *from;
+	ev.events = EPOLLIN;
+	ev.data.fd = clients[i].fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &ev) == -1){
+		perror("epoll_ctl");
+		exit(-1);
+	}
+	nclients++;
+	return &clients[i];
+}
+
+/*----- Relaying the datagrams queued on fd through im, to to on out -----*/
+/* to NULL relays what the senders send: out is the sender's socket,   */
+/* found with epfd, and the datagrams go to the receiver at server      */
+static void relay(int fd, int out, struct sockaddr_in *to, struct impair *im, int epfd,
+                  struct sockaddr_in *server)
+{
+	struct sockaddr_in from;
+	struct client *cl;
+	struct mmsghdr m;
+	struct iovec iov;
+	socklen_t fromlen;
+	ssize_t n;
+
+	for (;;){
+		fromlen = sizeof(from);
+		if ((n = recvfrom(fd, buf, DGRAM, MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen)) == -1){
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNREFUSED){
+				perror("recvfrom");
+				exit(-1);
+			}
+			return;
+		}
+		/* datagrams from the senders go out on their own socket */
+		if (to == NULL){
+			if ((cl = client_of(&from, epfd)) == NULL)
+				continue;
+			out = cl->fd;
+		}
+		memset(&m, 0, sizeof(m));
+		iov.iov_base = buf;
+		iov.iov_len = n;
+		m.msg_hdr.msg_name = to != NULL ? to : server;
+		m.msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		m.msg_hdr.msg_iov = &iov;
+		m.msg_hdr.msg_iovlen = 1;
+		if ((im == NULL || impair_msgs(im, out, &m, 1, scratch, DGRAM) == 1) &&
+		    sendmsg(out, &m.msg_hdr, MSG_DONTWAIT) == -1 && errno != EAGAIN && errno != ECONNREFUSED){
+			perror("sendmsg");
+			exit(-1);
+		}
+	}
+}
+
+/*----- The next time something held is due, 0 for none -----*/
+static uint64_t next_due(struct impair *up, struct impair *down)
+{
+	uint64_t u = up != NULL ? impair_release(up) : 0;
+	uint64_t d = down != NULL ? impair_release(down) : 0;
+
+	return u == 0 ? d : (d == 0 || u < d ? u : d);
+}
+
+int main(int argc, char *argv[]){
+	int lfd, tfd, epfd, i, n, opt;
+	struct impair *up = NULL;      /* sender to receiver                     */
+	struct impair *down = NULL;    /* receiver to sender                     */
+	struct sockaddr_in server, local;
+	struct epoll_event ev, evs[16];
+	struct itimerspec its;
+	struct hostent *he;
+	uint64_t due;
+
+	/*----- Checking arguments -----*/
+	while ((opt = getopt(argc, argv, "u:d:")) != -1){
+		switch (opt){
+		case 'u':
+		case 'd':
+			if (impair_new(optarg, opt == 'u' ? &up : &down) == -1){
+				fprintf(stderr, "proxy: bad impairment %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		default:
+			fprintf(stderr, "usage: proxy [-u spec] [-d spec] <port> <receiver> <receiver port>\n");
+			exit(-1);
+		}
+	}
+	if (argc - optind != 3){
+		fprintf(stderr, "usage: proxy [-u spec] [-d spec] <port> <receiver> <receiver port>\n");
+		exit(-1);
+	}
+
+	/*----- The receiver -----*/
+	if ((he = gethostbyname(argv[optind + 1])) == NULL){
+		perror("gethostbyname");
+		exit(-1);
+	}
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(atoi(argv[optind + 2]));
+	memcpy(&server.sin_addr.s_addr, he->h_addr, sizeof(server.sin_addr.s_addr));
+
+	/*----- The port the senders connect to -----*/
+	if ((lfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1){
+		perror("socket");
+		exit(-1);
+	}
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_port = htons(atoi(argv[optind]));
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(lfd, (struct sockaddr *)&local, sizeof(local)) == -1){
+		perror("bind");
+		exit(-1);
+	}
+
+	/*----- One loop for the sockets and the held datagrams -----*/
+	if ((epfd = epoll_create1(0)) == -1 ||
+	    (tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1){
+		perror("epoll_create1");
+		exit(-1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = lfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+	ev.data.fd = tfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+	for (;;){
+		if ((n = epoll_wait(epfd, evs, 16, -1)) == -1){
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(-1);
+		}
+		for (i = 0; i < n; i++){
+			if (evs[i].data.fd == tfd){
+				uint64_t expirations;
+				if (read(tfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN){
+					perror("read");
+					exit(-1);
+				}
+			}
+			else if (evs[i].data.fd == lfd){
+				relay(lfd, -1, NULL, up, epfd, &server);
+			}
+			else {
+				int k;
+				for (k = 0; k < nclients && clients[k].fd != evs[i].data.fd; k++)
+					;
+				if (k < nclients)
+					relay(clients[k].fd, lfd, &clients[k].addr, down, -1, NULL);
+			}
+		}
+
+		/*----- Sending what is due and waking up for the rest -----*/
+		due = next_due(up, down);
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = due / 1000000;
+		its.it_value.tv_nsec = (due % 1000000) * 1000;
+		if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1){
+			perror("timerfd_settime");
+			exit(-1);
+		}
+	}
+	return 0;
+}
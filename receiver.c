@@ -1,84 +1,406 @@
 #include "gbn.h"
 #include "helper.h"
+#include "fileio.h"
+#include <sys/epoll.h>
 
-int main(int argc, char *argv[])
-{
+#define BLOCK (4 * 1024 * 1024) /* bytes written to the file at a time     */
+#define DEPTH 4                 /* blocks the file stage writes behind     */
+
+/* one accepted connection and the file it is written to */
+struct transfer {
 	int sockfd;
-	int newSockfd;
-	int numRead;
-	char buf[DATALEN];
-	struct sockaddr_in server;
-	struct sockaddr_in client;
 	FILE *outputFile;
-	socklen_t socklen;
+	struct transfer *next;   /* next transfer of the shard's event loop     */
+};
 
-    strcpy(module_name, argv[0]);
-	/*----- Checking arguments -----*/
-	if (argc != 3){
-		fprintf(stderr, "usage: receiver <port> <filename>\n");
-		exit(-1);
+/* one listening socket sharing the port, served on its own core */
+struct shard {
+	int sockfd;
+	pthread_t thread;
+	pthread_attr_t attr;     /* pins the shard's threads to its CPU         */
+};
+
+static int maxconns = 1;     /* connections to serve, 0 serves forever      */
+static int pinned = 0;       /* pin each shard to a CPU                     */
+static int gro = 0;          /* receive GRO-coalesced datagrams             */
+static int ackEvery = ACK_EVERY; /* in-order packets per ACK                */
+static int ackDelay = ACK_DELAY; /* longest an ACK is held back (usec)      */
+static int payload = DATALEN; /* largest payload to negotiate               */
+static int fileStage = 0;    /* FIO_* flags of the async writer, 0 for none */
+static int nonblock = 0;     /* serve each shard from one epoll loop        */
+static int verbose = 0;      /* print the statistics of each connection     */
+static char *outputName;
+static int accepted = 0;     /* connections accepted by all shards          */
+static int finished = 0;     /* transfers written completely                */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+
+/*----- Closing a transfer that is complete -----*/
+static void finish(struct transfer *t)
+{
+	struct gbn_stats stats;
+
+	/*----- Statistics, one transfer at a time on stderr -----*/
+	if (verbose){
+		if (gbn_getstats(t->sockfd, &stats) == -1){
+			perror("gbn_getstats");
+			exit(-1);
+		}
+		pthread_mutex_lock(&lock);
+		print_stats(stderr, "receiver", &stats);
+		pthread_mutex_unlock(&lock);
 	}
 
-	/*----- Opening the output file -----*/
-	if ((outputFile = fopen(argv[2], "wb")) == NULL){
-		perror("fopen");
+	/*----- Closing the connection -----*/
+	if (gbn_close(t->sockfd) == -1){
+		perror("gbn_close");
 		exit(-1);
 	}
 
-	/*----- Opening the socket -----*/
-	if ((sockfd = gbn_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1){
-		perror("gbn_socket");
+	/*----- Closing the file -----*/
+	if (fclose(t->outputFile) == EOF){
+		perror("fclose");
 		exit(-1);
 	}
-	
-	/*--- Setting the server's parameters -----*/
-	memset(&server, 0, sizeof(struct sockaddr_in));
-	server.sin_family      = AF_INET;
-	server.sin_addr.s_addr = htonl(INADDR_ANY);
-	server.sin_port        = htons(atoi(argv[1]));
+	free(t);
+
+	pthread_mutex_lock(&lock);
+	finished++;
+	pthread_cond_signal(&done);
+	pthread_mutex_unlock(&lock);
+}
 
-	/*----- Binding to the designated port -----*/
-	if (gbn_bind(sockfd, (struct sockaddr *)&server, sizeof(struct sockaddr_in)) == -1){
-		perror("gbn_bind");
+/*----- Reading from the socket and dumping it to the file -----*/
+static void *serve(void *arg)
+{
+	struct transfer *t = arg;
+	struct fio *w = NULL;
+	char *buf;
+	int numRead;
+
+	/*----- Writing behind the transfer on io_uring or threads -----*/
+	if (fileStage){
+		if ((w = fio_open(fileno(t->outputFile), 1, BLOCK, DEPTH, fileStage)) == NULL){
+			perror("fio_open");
+			exit(-1);
+		}
+	}
+	else if ((buf = malloc(BLOCK)) == NULL){
+		perror("malloc");
 		exit(-1);
 	}
-	
-	/*----- Listening to new connections -----*/
-	if (gbn_listen(sockfd, 1) == -1){
-		perror("gbn_listen");
+	while(1){
+		if (w != NULL && (buf = fio_buffer(w)) == NULL){
+			perror("fio_buffer");
+			exit(-1);
+		}
+		/* whole blocks, only the last one is short */
+		if ((numRead = gbn_recv(t->sockfd, buf, BLOCK, MSG_WAITALL)) == -1){
+			perror("gbn_recv");
+			exit(-1);
+		}
+		else if (numRead == 0)
+			break;
+		if (w == NULL)
+			fwrite(buf, 1, numRead, t->outputFile);
+		else if (fio_write(w, buf, numRead) == -1){
+			perror("fio_write");
+			exit(-1);
+		}
+	}
+	if (w != NULL && verbose){
+		pthread_mutex_lock(&lock);
+		fprintf(stderr, "stats: receiver file_stage=%s\n", fio_backend(w));
+		pthread_mutex_unlock(&lock);
+	}
+	if (w == NULL)
+		free(buf);
+	else if (fio_close(w) == -1){
+		perror("fio_close");
 		exit(-1);
 	}
 
-	/*----- Waiting for the client to connect -----*/
-	socklen = sizeof(struct sockaddr_in);
-	newSockfd = gbn_accept(sockfd, (struct sockaddr *)&client, &socklen);
-	if (newSockfd == -1){
-		perror("gbn_accept");
+	finish(t);
+	return NULL;
+}
+
+/*----- Opening the output file of a new client -----*/
+/* NULL if another shard took the last slot */
+static struct transfer *admit(int newSockfd)
+{
+	struct transfer *t;
+	char fname[4096];
+	int n;
+
+	pthread_mutex_lock(&lock);
+	n = accepted++;
+	pthread_mutex_unlock(&lock);
+	if (maxconns > 0 && n >= maxconns){
+		gbn_close(newSockfd);
+		return NULL;
+	}
+
+	/* a single client writes to <filename>, several to <filename>.<n> */
+	if (maxconns == 1)
+		snprintf(fname, sizeof(fname), "%s", outputName);
+	else
+		snprintf(fname, sizeof(fname), "%s.%d", outputName, n);
+	if ((t = malloc(sizeof(struct transfer))) == NULL){
+		perror("malloc");
 		exit(-1);
 	}
+	t->sockfd = newSockfd;
+	t->next = NULL;
+	if ((t->outputFile = fopen(fname, "wb")) == NULL){
+		perror("fopen");
+		exit(-1);
+	}
+	return t;
+}
 
-    /*----- Reading from the socket and dumping it to the file -----*/
-    while(1){
-        if ((numRead = gbn_recv(sockfd, buf, DATALEN, 0)) == -1){
-            perror("gbn_recv");
-            exit(-1);
-        }
-        else if (numRead == 0)
-            break;
-        fwrite(buf, 1, numRead, outputFile);
-    }
+/*----- Serving every client of one shard from a single thread -----*/
+/* the socket never blocks, the thread sleeps in epoll until the library */
+/* has packets or a timer to take care of, then reads what arrived       */
+static void event_loop(struct shard *sh)
+{
+	struct transfer *list = NULL;
+	struct transfer **pp;
+	struct transfer *t;
+	struct epoll_event ev;
+	char *buf;
+	int newSockfd;
+	int numRead;
+	int epfd;
 
-	/*----- Closing the socket -----*/
-	if (gbn_close(sockfd) == -1){
-		perror("gbn_close");
+	if ((buf = malloc(BLOCK)) == NULL){
+		perror("malloc");
 		exit(-1);
 	}
+	ev.events = EPOLLIN;
+	ev.data.fd = sh->sockfd;
+	if ((epfd = epoll_create1(0)) == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, gbn_fd(sh->sockfd), &ev) == -1){
+		perror("epoll");
+		exit(-1);
+	}
+	while (1){
+		if (epoll_wait(epfd, &ev, 1, -1) == -1 && errno != EINTR){
+			perror("epoll_wait");
+			exit(-1);
+		}
+		gbn_process_timers(sh->sockfd);
 
-	/*----- Closing the file -----*/
-	if (fclose(outputFile) == EOF){
-		perror("fclose");
+		/*----- Taking the new clients -----*/
+		while ((newSockfd = gbn_accept(sh->sockfd, NULL, NULL)) != -1){
+			if ((t = admit(newSockfd)) != NULL){
+				t->next = list;
+				list = t;
+			}
+		}
+		if (errno != EAGAIN){
+			perror("gbn_accept");
+			exit(-1);
+		}
+
+		/*----- Writing what arrived for each of them -----*/
+		for (pp = &list; (t = *pp) != NULL; ){
+			while ((numRead = gbn_recv(t->sockfd, buf, BLOCK, 0)) > 0)
+				fwrite(buf, 1, numRead, t->outputFile);
+			if (numRead == -1 && errno == EAGAIN){
+				pp = &t->next;
+				continue;
+			}
+			if (numRead == -1){
+				perror("gbn_recv");
+				exit(-1);
+			}
+			*pp = t->next;
+			finish(t);
+		}
+	}
+}
+
+/*----- Accepting clients of one shard, each one in its own thread -----*/
+/* the kernel hashes every flow to one socket, so all of a flow's packets */
+/* are handled by threads of the same shard                               */
+static void *worker(void *arg)
+{
+	struct shard *sh = arg;
+	struct sockaddr_in client;
+	struct transfer *t;
+	pthread_t thread;
+	socklen_t socklen;
+	int newSockfd;
+
+	if (nonblock){
+		event_loop(sh);
+		return NULL;
+	}
+	while (1){
+		/*----- Waiting for the client to connect -----*/
+		socklen = sizeof(struct sockaddr_in);
+		newSockfd = gbn_accept(sh->sockfd, (struct sockaddr *)&client, &socklen);
+		if (newSockfd == -1){
+			perror("gbn_accept");
+			exit(-1);
+		}
+		if ((t = admit(newSockfd)) == NULL)
+			continue;
+
+		if (pthread_create(&thread, &sh->attr, serve, t) != 0){
+			perror("pthread_create");
+			exit(-1);
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	int i;
+	int nshards = 1;     /* sockets sharing the port, one per core          */
+	int direct = 0;      /* write with O_DIRECT, needs -i                   */
+	int ncpus;
+	struct sockaddr_in server;
+	struct shard *shards;
+	cpu_set_t cpus;
+
+	/*----- Checking arguments -----*/
+	while ((opt = getopt(argc, argv, "m:t:agk:d:l:i:Dnv")) != -1){
+		switch (opt){
+			case 'm':
+				maxconns = atoi(optarg);
+				break;
+			case 't':
+				nshards = atoi(optarg);
+				break;
+			case 'a':
+				pinned = 1;
+				break;
+			case 'g':
+				gro = 1;
+				break;
+			case 'k':
+				ackEvery = atoi(optarg);
+				break;
+			case 'd':
+				ackDelay = atoi(optarg);
+				break;
+			case 'l':
+				payload = atoi(optarg);
+				break;
+			case 'i':
+				if (strcmp(optarg, "uring") == 0)
+					fileStage |= FIO_URING;
+				else if (strcmp(optarg, "threads") == 0)
+					fileStage |= FIO_THREADS;
+				else
+					argc = 0;
+				break;
+			case 'D':
+				direct = 1;
+				break;
+			case 'n':
+				nonblock = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				argc = 0;
+		}
+	}
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nshards == 0)
+		nshards = ncpus;
+	if (argc - optind != 2 || maxconns < 0 || nshards < 1 || (direct && !fileStage) || (nonblock && fileStage)){
+		fprintf(stderr, "usage: receiver [-m connections] [-t threads] [-a] [-g] [-k acks] [-d delay] [-l payload] [-i uring|threads [-D] | -n] [-v] <port> <filename>\n");
 		exit(-1);
 	}
-			
+	if (direct)
+		fileStage |= FIO_DIRECT;
+	argv += optind - 1;
+	outputName = argv[2];
+
+	/*--- Setting the server's parameters -----*/
+	memset(&server, 0, sizeof(struct sockaddr_in));
+	server.sin_family      = AF_INET;
+	server.sin_addr.s_addr = htonl(INADDR_ANY);
+	server.sin_port        = htons(atoi(argv[1]));
+
+	shards = calloc(nshards, sizeof(struct shard));
+	for (i = 0; i < nshards; i++){
+		struct shard *sh = &shards[i];
+		int on = 1;
+		int cpu = i % ncpus;
+
+		/*----- Opening the socket -----*/
+		if ((sh->sockfd = gbn_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1){
+			perror("gbn_socket");
+			exit(-1);
+		}
+
+		/*----- Sharing the port between the shards -----*/
+		if (nshards > 1 && gbn_setsockopt(sh->sockfd, GBN_REUSEPORT, &on, sizeof(on)) == -1){
+			perror("gbn_setsockopt");
+			exit(-1);
+		}
+		if (gro && gbn_setsockopt(sh->sockfd, GBN_GRO, &gro, sizeof(gro)) == -1){
+			perror("gbn_setsockopt");
+			exit(-1);
+		}
+		/*----- Negotiating the payload -----*/
+		if (gbn_setsockopt(sh->sockfd, GBN_PAYLOAD, &payload, sizeof(payload)) == -1){
+			perror("gbn_setsockopt");
+			exit(-1);
+		}
+		if (nonblock && gbn_setsockopt(sh->sockfd, GBN_NONBLOCK, &nonblock, sizeof(nonblock)) == -1){
+			perror("gbn_setsockopt");
+			exit(-1);
+		}
+		/*----- Setting the ACK policy -----*/
+		if (gbn_setsockopt(sh->sockfd, GBN_ACK_EVERY, &ackEvery, sizeof(ackEvery)) == -1 ||
+			gbn_setsockopt(sh->sockfd, GBN_ACK_DELAY, &ackDelay, sizeof(ackDelay)) == -1){
+			perror("gbn_setsockopt");
+			exit(-1);
+		}
+		pthread_attr_init(&sh->attr);
+		if (pinned){
+			if (gbn_setsockopt(sh->sockfd, GBN_CPU, &cpu, sizeof(cpu)) == -1){
+				perror("gbn_setsockopt");
+				exit(-1);
+			}
+			CPU_ZERO(&cpus);
+			CPU_SET(cpu, &cpus);
+			pthread_attr_setaffinity_np(&sh->attr, sizeof(cpus), &cpus);
+		}
+
+		/*----- Binding to the designated port -----*/
+		if (gbn_bind(sh->sockfd, (struct sockaddr *)&server, sizeof(struct sockaddr_in)) == -1){
+			perror("gbn_bind");
+			exit(-1);
+		}
+
+		/*----- Listening to new connections -----*/
+		if (gbn_listen(sh->sockfd, maxconns == 1 ? 1 : BACKLOG) == -1){
+			perror("gbn_listen");
+			exit(-1);
+		}
+
+		if (pthread_create(&sh->thread, &sh->attr, worker, sh) != 0){
+			perror("pthread_create");
+			exit(-1);
+		}
+	}
+
+	/*----- Waiting for every transfer to complete -----*/
+	pthread_mutex_lock(&lock);
+	while (maxconns == 0 || finished < maxconns)
+		pthread_cond_wait(&done, &lock);
+	pthread_mutex_unlock(&lock);
+
+	/*----- Closing the sockets -----*/
+	/* workers are still blocked in gbn_accept, exiting closes their sockets */
 	return (0);
 }
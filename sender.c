@@ -1,30 +1,166 @@
 #include "gbn.h"
 #include "helper.h"
+#include "fileio.h"
+#include <sys/stat.h>
+#include <sys/epoll.h>
+
+#define BLOCK (1024 * 1024)  /* bytes the file stage reads at a time        */
+#define DEPTH 4              /* blocks the file stage reads ahead           */
 
 #define h_addr h_addr_list[0]
 
+static int epfd = -1;       /* event loop of the non-blocking mode          */
+
+/*----- Waiting for the library to have something to do -----*/
+/* a real application would serve its other sockets from the same loop */
+static void wait_ready(int sockfd)
+{
+	struct epoll_event ev;
+
+	if (epoll_wait(epfd, &ev, 1, -1) == -1 && errno != EINTR){
+		perror("epoll_wait");
+		exit(-1);
+	}
+	if (gbn_process_timers(sockfd) == -1){
+		perror("gbn_process_timers");
+		exit(-1);
+	}
+}
+
+/*----- Sending a whole buffer, also when the socket doesn't block -----*/
+static void send_all(int sockfd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0){
+		if ((n = gbn_send(sockfd, buf, len, 0)) == -1){
+			if (errno != EAGAIN){
+				perror("gbn_send");
+				exit(-1);
+			}
+			wait_ready(sockfd);
+			continue;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
 int main(int argc, char *argv[]){
 	int sockfd;          /* socket file descriptor of the client            */
 	int numRead;
 	socklen_t socklen;	 /* length of the socket structure sockaddr         */
-	char buf[DATALEN * N];   /* buffer to send packets                       */
+	char *buf;           /* N packets read from the file per gbn_send       */
+	int readFile = 0;    /* fread and gbn_send instead of gbn_sendfile      */
+	int fileStage = 0;   /* FIO_* flags of the async reader, 0 for none     */
+	int direct = 0;      /* read with O_DIRECT, needs -i                    */
+	struct fio *r;
+	struct stat st;
 	struct hostent *he;	 /* structure for resolving names into IP addresses */
 	FILE *inputFile;     /* input file pointer                              */
 	struct sockaddr_in server;
+	int opt;
+	int window = WINSIZE; /* sender window in packets                       */
+	int gso = 0;         /* send window bursts with UDP GSO                 */
+	int crc = 0;         /* ask for CRC32C checksums                        */
+	int sack = 0;        /* ask for Selective Repeat                        */
+	int cc = GBN_CC_CUBIC; /* congestion controller                         */
+	int pacing = GBN_PACE_USER; /* how packets are spread over the RTT       */
+	int rate = 0;        /* fixed pacing rate in bytes/s, 0 follows cwnd    */
+	int payload = DATALEN; /* largest payload to negotiate                  */
+	int pmtu = 0;        /* keep packets within the path MTU                */
+	int dupThresh = DUP_THRESH; /* duplicate ACKs before a fast retransmit  */
+	int fec = 0;         /* DATA packets per parity packet, 0 none          */
+	int nonblock = 0;    /* drive the transfer from an epoll loop           */
+	int verbose = 0;     /* print the statistics of the connection          */
+	struct gbn_stats stats;
+	struct epoll_event ev;
+	off_t off;
+	ssize_t sent;
 
 	socklen = sizeof(struct sockaddr);
-    strcpy(module_name, argv[0]);
-
-	/* Print Starting Time */
-	char time_str[255];
-	get_current_time(&time_str, sizeof(time_str));
-	DBG_PRINT("Start Time: %s", time_str);
 
 	/*----- Checking arguments -----*/
-	if (argc != 4){
-		fprintf(stderr, "usage: sender <hostname> <port> <filename>\n");
+	while ((opt = getopt(argc, argv, "w:gcsC:p:r:l:mF:e:fi:Dnv")) != -1){
+		switch (opt){
+			case 'w':
+				window = atoi(optarg);
+				break;
+			case 'g':
+				gso = 1;
+				break;
+			case 'c':
+				crc = 1;
+				break;
+			case 's':
+				sack = 1;
+				break;
+			case 'C':
+				if (strcmp(optarg, "none") == 0)
+					cc = GBN_CC_NONE;
+				else if (strcmp(optarg, "reno") == 0)
+					cc = GBN_CC_RENO;
+				else if (strcmp(optarg, "cubic") == 0)
+					cc = GBN_CC_CUBIC;
+				else
+					argc = 0;
+				break;
+			case 'p':
+				if (strcmp(optarg, "off") == 0)
+					pacing = GBN_PACE_OFF;
+				else if (strcmp(optarg, "user") == 0)
+					pacing = GBN_PACE_USER;
+				else if (strcmp(optarg, "txtime") == 0)
+					pacing = GBN_PACE_TXTIME;
+				else
+					argc = 0;
+				break;
+			case 'r':
+				rate = atoi(optarg);
+				break;
+			case 'l':
+				payload = atoi(optarg);
+				break;
+			case 'm':
+				pmtu = 1;
+				break;
+			case 'F':
+				dupThresh = atoi(optarg);
+				break;
+			case 'e':
+				fec = strcmp(optarg, "auto") == 0 ? GBN_FEC_AUTO : atoi(optarg);
+				break;
+			case 'f':
+				readFile = 1;
+				break;
+			case 'i':
+				if (strcmp(optarg, "uring") == 0)
+					fileStage |= FIO_URING;
+				else if (strcmp(optarg, "threads") == 0)
+					fileStage |= FIO_THREADS;
+				else
+					argc = 0;
+				break;
+			case 'D':
+				direct = 1;
+				break;
+			case 'n':
+				nonblock = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				argc = 0;
+		}
+	}
+	if (argc - optind != 3 || (direct && !fileStage)){
+		fprintf(stderr, "usage: sender [-w window] [-g] [-c] [-s] [-C none|reno|cubic] [-p off|user|txtime] [-r rate] [-l payload] [-m] [-F dups] [-e k|auto] [-f | -i uring|threads [-D]] [-n] [-v] <hostname> <port> <filename>\n");
 		exit(-1);
 	}
+	if (direct)
+		fileStage |= FIO_DIRECT;
+	argv += optind - 1;
 	
 	/*----- Opening the input file -----*/
 	if ((inputFile = fopen(argv[3], "rb")) == NULL){
@@ -44,6 +180,76 @@ int main(int argc, char *argv[]){
 		exit(-1);
 	}
 
+	/*----- Setting the window size -----*/
+	if (gbn_setsockopt(sockfd, GBN_WINDOW, &window, sizeof(window)) == -1){
+		perror("gbn_setsockopt");
+		exit(-1);
+	}
+
+	/*----- Letting the kernel segment the bursts -----*/
+	if (gbn_setsockopt(sockfd, GBN_GSO, &gso, sizeof(gso)) == -1){
+		perror("gbn_setsockopt");
+		exit(-1);
+	}
+
+	/*----- Asking for CRC32C checksums -----*/
+	if (gbn_setsockopt(sockfd, GBN_CRC32C, &crc, sizeof(crc)) == -1){
+		perror("gbn_setsockopt");
+		exit(-1);
+	}
+
+	/*----- Asking for Selective Repeat -----*/
+	if (gbn_setsockopt(sockfd, GBN_SACK, &sack, sizeof(sack)) == -1){
+		perror("gbn_setsockopt");
+		exit(-1);
+	}
+
+	/*----- Picking the congestion controller -----*/
+	if (gbn_setsockopt(sockfd, GBN_CC, &cc, sizeof(cc)) == -1){
+		perror("gbn_setsockopt");
+		exit(-1);
+	}
+
+	/*----- Pacing the packets -----*/
+	if (gbn_setsockopt(sockfd, GBN_PACING, &pacing, sizeof(pacing)) == -1 ||
+		gbn_setsockopt(sockfd, GBN_PACE_RATE, &rate, sizeof(rate)) == -1){
+		perror("gbn_setsockopt");
+		exit(-1);
+	}
+
+	/*----- Negotiating the payload -----*/
+	if (gbn_setsockopt(sockfd, GBN_PAYLOAD, &payload, sizeof(payload)) == -1 ||
+		gbn_setsockopt(sockfd, GBN_PMTU, &pmtu, sizeof(pmtu)) == -1){
+		perror("gbn_setsockopt");
+		exit(-1);
+	}
+
+	/*----- Resending on duplicate ACKs -----*/
+	if (gbn_setsockopt(sockfd, GBN_DUPTHRESH, &dupThresh, sizeof(dupThresh)) == -1){
+		perror("gbn_setsockopt");
+		exit(-1);
+	}
+
+	/*----- A parity packet per k DATA packets -----*/
+	if (fec && gbn_setsockopt(sockfd, GBN_FEC, &fec, sizeof(fec)) == -1){
+		perror("gbn_setsockopt");
+		exit(-1);
+	}
+
+	/*----- Never blocking in the library, waiting in our own loop -----*/
+	if (nonblock){
+		if (gbn_setsockopt(sockfd, GBN_NONBLOCK, &nonblock, sizeof(nonblock)) == -1){
+			perror("gbn_setsockopt");
+			exit(-1);
+		}
+		ev.events = EPOLLIN;
+		ev.data.fd = sockfd;
+		if ((epfd = epoll_create1(0)) == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, gbn_fd(sockfd), &ev) == -1){
+			perror("epoll");
+			exit(-1);
+		}
+	}
+
 	/*--- Setting the server's parameters -----*/
 	memset(&server, 0, sizeof(struct sockaddr_in));
 	server.sin_family = AF_INET;
@@ -53,20 +259,88 @@ int main(int argc, char *argv[]){
 
 	/*----- Connecting to the server -----*/
 	if (gbn_connect(sockfd, (struct sockaddr *)&server, socklen) == -1){
-		perror("gbn_connect");
-		exit(-1);
+		if (errno != EINPROGRESS){
+			perror("gbn_connect");
+			exit(-1);
+		}
+		while (!(gbn_poll(sockfd) & (GBN_POLLOUT | GBN_POLLERR)))
+			wait_ready(sockfd);
+		if (gbn_poll(sockfd) & GBN_POLLERR){
+			fprintf(stderr, "gbn_connect: server not answering\n");
+			exit(-1);
+		}
+	}
+
+	/*----- Sending the file straight from the page cache -----*/
+	if (!readFile && !fileStage){
+		if (fstat(fileno(inputFile), &st) == -1){
+			perror("fstat");
+			exit(-1);
+		}
+		for (off = 0; off < st.st_size; off += sent){
+			if ((sent = gbn_sendfile(sockfd, fileno(inputFile), off, st.st_size - off)) == -1){
+				if (errno != EAGAIN){
+					perror("gbn_sendfile");
+					exit(-1);
+				}
+				wait_ready(sockfd);
+				sent = 0;
+			}
+		}
+	}
+
+	/*----- Reading ahead of the transfer on io_uring or threads -----*/
+	else if (fileStage){
+		if ((r = fio_open(fileno(inputFile), 0, BLOCK, DEPTH, fileStage)) == NULL){
+			perror("fio_open");
+			exit(-1);
+		}
+		while ((numRead = fio_read(r, &buf)) > 0)
+			send_all(sockfd, buf, numRead);
+		if (numRead == -1){
+			perror("fio_read");
+			exit(-1);
+		}
+		if (verbose)
+			fprintf(stderr, "stats: sender file_stage=%s\n", fio_backend(r));
+		fio_close(r);
 	}
 
     /*----- Reading from the file and sending it through the socket -----*/
-    while ((numRead = fread(buf, 1, DATALEN * N, inputFile)) > 0){
-        if (gbn_send(sockfd, buf, numRead, 0) == -1){
-            perror("gbn_send");
-            exit(-1);
-        }
-    }
+	else {
+		if ((buf = malloc((size_t)payload * N)) == NULL){
+			perror("malloc");
+			exit(-1);
+		}
+		while ((numRead = fread(buf, 1, (size_t)payload * N, inputFile)) > 0)
+			send_all(sockfd, buf, numRead);
+		free(buf);
+	}
+
+	/*----- Statistics, once everything is ACK'd -----*/
+	if (verbose){
+		while (gbn_send(sockfd, NULL, 0, MSG_WAITALL) == -1){
+			if (errno != EAGAIN){
+				perror("gbn_send");
+				exit(-1);
+			}
+			wait_ready(sockfd);
+		}
+		if (gbn_getstats(sockfd, &stats) == -1){
+			perror("gbn_getstats");
+			exit(-1);
+		}
+		print_stats(stderr, "sender", &stats);
+	}
 
 	/*----- Closing the socket -----*/
-	if (gbn_close(sockfd) == -1){
+	while ((numRead = gbn_close(sockfd)) == -1 && errno == EAGAIN)
+		wait_ready(sockfd);
+	if (numRead == -2){
+		fprintf(stderr, "gbn_close: data lost, receiver not answering\n");
+		exit(-1);
+	}
+	if (numRead < 0){
 		perror("gbn_close");
 		exit(-1);
 	}
@@ -77,9 +351,6 @@ int main(int argc, char *argv[]){
 		exit(-1);
 	}
 
-	get_current_time(&time_str, sizeof(time_str));
-	DBG_PRINT("End Time: %s", time_str);
-
 	return(0);
 }
 
@@ -0,0 +1,286 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define RING     8192         /* events a thread buffers, a power of 2       */
+#define STRINGS  256          /* format strings remembered as written        */
+#define IDLE_NS  1000000      /* the writer sleeps this long on empty rings  */
+#define FILEBUF  (1 << 20)    /* stdio buffer of the trace file              */
+
+/* the events of one thread. Only the thread moves head and only the writer */
+/* moves tail; a ring outlives its thread and is handed to the next one      */
+struct trace_ring {
+    struct trace_rec recs[RING];
+    uint32_t head;            /* next slot the thread fills                 */
+    uint32_t tail;            /* next slot the writer takes                 */
+    uint32_t lost;            /* events dropped on a full ring              */
+    uint32_t lost_written;    /* of which the writer reported               */
+    uint16_t thread;
+    int idle;                 /* its thread exited                          */
+    struct trace_ring* next;
+};
+
+static __thread struct trace_ring* mine = NULL;
+static struct trace_ring* rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static pthread_t writer;
+static uint16_t threads = 0;
+static int off = 0;           /* no GBN_TRACE or the file can't be opened  */
+static int stopping = 0;
+static FILE* out = NULL;
+static const char* strings[STRINGS];
+static int nstrings = 0;
+
+static uint64_t now_nsec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*----- The writer -----*/
+static void put(const void* data, size_t len){
+    if (fwrite_unlocked(data, 1, len, out) != len){
+        off = 1;
+    }
+}
+
+/* the first time a format string is seen its bytes go before the event */
+static void put_string(const char* s){
+    struct trace_rec rec;
+    size_t len = strlen(s) + 1;
+    uintptr_t p = (uintptr_t)s;
+    char pad[sizeof(struct trace_rec)];
+    int i;
+    for (i = 0; i < nstrings; i++){
+        if (strings[i] == s){
+            return;
+        }
+    }
+    if (nstrings < STRINGS){
+        strings[nstrings++] = s;
+    }
+    memset(&rec, 0, sizeof(rec));
+    memset(pad, 0, sizeof(pad));
+    rec.id = TR_STRING;
+    rec.arg[0] = (uint32_t)p;
+    rec.arg[1] = (uint32_t)((uint64_t)p >> 32);
+    rec.arg[2] = len;
+    put(&rec, sizeof(rec));
+    put(s, len);
+    put(pad, (sizeof(rec) - len % sizeof(rec)) % sizeof(rec));
+}
+
+/* writes out what the rings hold, returns how many events that was */
+static uint32_t drain(void){
+    struct trace_ring* r;
+    struct trace_rec lost;
+    uint32_t head, tail, start, total = 0;
+    pthread_mutex_lock(&rings_lock);
+    for (r = rings; r != NULL; r = r->next){
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = r->tail;
+        /* in contiguous runs, broken where the ring wraps and before */
+        /* the messages whose format string must be written first     */
+        for (start = tail; tail != head; tail++){
+            if ((tail & (RING - 1)) == 0 && tail != start){
+                put(&r->recs[start & (RING - 1)], (size_t)(tail - start) * sizeof(struct trace_rec));
+                start = tail;
+            }
+            if (r->recs[tail & (RING - 1)].id == TR_MSG){
+                const struct trace_rec* m = &r->recs[tail & (RING - 1)];
+                put(&r->recs[start & (RING - 1)], (size_t)(tail - start) * sizeof(struct trace_rec));
+                put_string((const char*)(uintptr_t)((uint64_t)m->arg[1] << 32 | m->arg[0]));
+                start = tail;
+            }
+        }
+        put(&r->recs[start & (RING - 1)], (size_t)(tail - start) * sizeof(struct trace_rec));
+        total += head - r->tail;
+        __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+
+        head = __atomic_load_n(&r->lost, __ATOMIC_RELAXED);
+        if (head != r->lost_written){
+            memset(&lost, 0, sizeof(lost));
+            lost.ts = now_nsec();
+            lost.id = TR_LOST;
+            lost.thread = r->thread;
+            lost.arg[0] = head - r->lost_written;
+            put(&lost, sizeof(lost));
+            r->lost_written = head;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    if (total != 0){
+        fflush(out);
+    }
+    return total;
+}
+
+static void* write_loop(void* arg){
+    struct timespec idle = {0, IDLE_NS};
+    (void)arg;
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)){
+        if (drain() == 0){
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* events traced until exit() are still written */
+static void trace_exit(void){
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    drain();
+    fclose(out);
+}
+
+/* a ring is kept for the next thread once it has been written out */
+static void thread_exit(void* arg){
+    __atomic_store_n(&((struct trace_ring*)arg)->idle, 1, __ATOMIC_RELEASE);
+}
+
+static void trace_init(void){
+    const char* name = getenv("GBN_TRACE");
+    struct trace_rec start;
+    struct timespec wall;
+    /* opt-in: without a file name nothing is recorded and no writer runs */
+    if (name == NULL || *name == '\0' || strcmp(name, "off") == 0){
+        off = 1;
+        return;
+    }
+    if ((out = fopen(name, "w")) == NULL){
+        off = 1;
+        return;
+    }
+    setvbuf(out, NULL, _IOFBF, FILEBUF);
+    pthread_key_create(&key, thread_exit);
+
+    memset(&start, 0, sizeof(start));
+    clock_gettime(CLOCK_REALTIME, &wall);
+    start.ts = now_nsec();
+    start.id = TR_START;
+    start.arg[0] = (uint32_t)wall.tv_sec;
+    start.arg[1] = (uint32_t)((uint64_t)wall.tv_sec >> 32);
+    start.arg[2] = wall.tv_nsec;
+    start.arg[3] = getpid();
+    start.arg[4] = TRACE_MAGIC;
+    put(&start, sizeof(start));
+
+    if (pthread_create(&writer, NULL, write_loop, NULL) != 0){
+        fclose(out);
+        off = 1;
+        return;
+    }
+    atexit(trace_exit);
+}
+
+/* the ring of the calling thread, NULL when tracing is off */
+static struct trace_ring* ring_get(void){
+    struct trace_ring* r;
+    pthread_once(&once, trace_init);
+    if (off){
+        return NULL;
+    }
+    pthread_mutex_lock(&rings_lock);
+    for (r = rings; r != NULL; r = r->next){
+        if (__atomic_load_n(&r->idle, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&r->head, __ATOMIC_RELAXED) == r->tail){
+            break;
+        }
+    }
+    if (r == NULL && (r = calloc(1, sizeof(*r))) != NULL){
+        r->next = rings;
+        rings = r;
+    }
+    if (r != NULL){
+        r->idle = 0;
+        r->thread = threads++;
+        pthread_setspecific(key, r);
+    }
+    pthread_mutex_unlock(&rings_lock);
+    return mine = r;
+}
+
+/*----- Tracing -----*/
+void trace_event(int id, uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t e){
+    struct trace_ring* r = mine;
+    struct trace_rec* rec;
+    uint32_t head;
+    if (r == NULL && (off || (r = ring_get()) == NULL)){
+        return;
+    }
+    head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING){
+        __atomic_store_n(&r->lost, r->lost + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rec = &r->recs[head & (RING - 1)];
+    rec->ts = now_nsec();
+    rec->id = id;
+    rec->thread = r->thread;
+    rec->arg[0] = a;
+    rec->arg[1] = b;
+    rec->arg[2] = c;
+    rec->arg[3] = d;
+    rec->arg[4] = e;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* a message as tracedump prints it, one line on stderr */
+static void msg_print(const char* fmt, int err, const uint32_t* args){
+    char line[512];
+    size_t len = 0;
+    int n = 0;
+    for (; *fmt != '\0' && len < sizeof(line) - 1; fmt++){
+        if (*fmt != '%'){
+            line[len++] = *fmt;
+            continue;
+        }
+        switch (*(++fmt)){
+            case 's':
+                len += snprintf(line + len, sizeof(line) - len, "%s", err == 0 ? "None" : strerror(err));
+                break;
+            case 'd':
+                len += snprintf(line + len, sizeof(line) - len, "%d", n < 2 ? (int)args[n++] : 0);
+                break;
+            case '\0':
+                fmt--;
+                break;
+            default:
+                line[len++] = *fmt;
+        }
+    }
+    line[len < sizeof(line) ? len : sizeof(line) - 1] = '\0';
+    fprintf(stderr, "%s\n", line);
+}
+
+void trace_msg(int level, const char* fmt, int err, ...){
+    uintptr_t p = (uintptr_t)fmt;
+    uint32_t args[2] = {0, 0};
+    const char* f;
+    int n = 0;
+    va_list list;
+    va_start(list, err);
+    for (f = fmt; *f != '\0' && n < 2; f++){
+        if (f[0] == '%' && f[1] == 'd'){
+            args[n++] = va_arg(list, int);
+        }
+    }
+    va_end(list);
+    if (mine == NULL && ring_get() == NULL){
+        /* not traced: errors still go to stderr, the rest is dropped */
+        if (level <= TRACE_ERROR){
+            msg_print(fmt, err, args);
+        }
+        return;
+    }
+    trace_event(TR_MSG, (uint32_t)p, (uint32_t)((uint64_t)p >> 32), err, args[0], args[1]);
+}
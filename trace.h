@@ -0,0 +1,73 @@
+#ifndef GBN_TRACE_H
+#define GBN_TRACE_H
+
+#include <stdint.h>
+
+/*----- Binary trace -----*/
+/* events are fixed size records appended to a ring of the calling thread, */
+/* without locks or system calls; a background thread writes the rings to  */
+/* the file named by GBN_TRACE in the environment (none if it is unset,    */
+/* empty or "off"). tracedump decodes the file. Events above                */
+/* GBN_TRACE_LEVEL are compiled out, make TRACE=n sets it                   */
+
+#define TRACE_NONE   0
+#define TRACE_ERROR  1    /* failures, DBG_ERROR                           */
+#define TRACE_INFO   2    /* connections and timeouts, the default         */
+#define TRACE_PKT    3    /* every packet, ACK and RTT sample              */
+#define TRACE_DEBUG  4    /* DBG_PRINT                                     */
+
+#ifndef GBN_TRACE_LEVEL
+#define GBN_TRACE_LEVEL TRACE_INFO
+#endif
+
+#define TRACE_MAGIC  0x54424e47 /* "GBNT", last argument of TR_START       */
+
+/* name, level and how tracedump prints the arguments. Connections are */
+/* told apart by the port of the peer, the first argument              */
+#define TRACE_EVENTS(X) \
+    X(TR_START,       TRACE_NONE,  NULL) \
+    X(TR_STRING,      TRACE_NONE,  NULL) \
+    X(TR_LOST,        TRACE_NONE,  "%u events lost, the ring was full") \
+    X(TR_MSG,         TRACE_NONE,  NULL) \
+    X(TR_ESTABLISHED, TRACE_INFO,  "port %u established, payload %u flags 0x%x") \
+    X(TR_CLOSED,      TRACE_INFO,  "port %u closed, %u packets sent %u received") \
+    X(TR_TIMEOUT,     TRACE_INFO,  "port %u timeout, base %u next %u rto %u attempt %u") \
+    X(TR_FAST_RETX,   TRACE_INFO,  "port %u fast retransmit, base %u next %u after %u duplicate ACKs") \
+    X(TR_DATA_OUT,    TRACE_PKT,   "port %u DATA out %u len %u transmission %u") \
+    X(TR_DATA_IN,     TRACE_PKT,   "port %u DATA in %u len %u expected %u") \
+    X(TR_ACK_OUT,     TRACE_PKT,   "port %u ACK out %u") \
+    X(TR_ACK_IN,      TRACE_PKT,   "port %u ACK in %u base %u next %u cwnd %u") \
+    X(TR_RTT,         TRACE_PKT,   "port %u rtt %u srtt %u rttvar %u rto %u") \
+    X(TR_FEC_REPAIR,  TRACE_INFO,  "port %u rebuilt %u from the parity of the block at %u, %u packets")
+
+#define TRACE_ID(name, level, fmt) name,
+#define TRACE_LVL(name, level, fmt) name##_LEVEL = level,
+enum { TRACE_EVENTS(TRACE_ID) TR_COUNT };
+enum { TRACE_EVENTS(TRACE_LVL) TR_LEVEL_END };
+#undef TRACE_ID
+#undef TRACE_LVL
+
+/* one event. TR_START carries the wall clock (sec low, high, nsec), the  */
+/* pid and TRACE_MAGIC; TR_STRING the address (low, high) and length of a */
+/* format string, whose bytes follow padded to whole records; TR_MSG the  */
+/* address of its format string, errno and up to two ints                 */
+struct trace_rec {
+    uint64_t ts;              /* CLOCK_MONOTONIC (nsec)                     */
+    uint16_t id;              /* TR_*                                       */
+    uint16_t thread;          /* threads are numbered as they first trace   */
+    uint32_t arg[5];
+};
+
+#define TRACE(ev, a, b, c, d, e) \
+    do { if (ev##_LEVEL <= GBN_TRACE_LEVEL) trace_event(ev, a, b, c, d, e); } while (0)
+
+/* a printf-like message: fmt must be a string literal, %d takes an int */
+/* argument and %s stands for the errno at the call. Without GBN_TRACE  */
+/* TRACE_ERROR messages are printed on stderr instead                   */
+#define TRACE_MSG(level, fmt, ...) \
+    do { if ((level) <= GBN_TRACE_LEVEL) trace_msg(level, fmt, errno, ##__VA_ARGS__); } while (0)
+
+void trace_event(int id, uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t e);
+void trace_msg(int level, const char* fmt, int err, ...);
+
+#endif
@@ -0,0 +1,147 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/* an event and where it was in the file, which breaks ties in the sort */
+struct event {
+	struct trace_rec rec;
+	size_t order;
+};
+
+/* a format string of TR_MSG, by its address in the traced process */
+struct string {
+	uint64_t addr;
+	char *text;
+};
+
+static const char *formats[] = {
+#define TRACE_FMT(name, level, fmt) fmt,
+	TRACE_EVENTS(TRACE_FMT)
+#undef TRACE_FMT
+};
+
+static struct string *strings = NULL;
+static size_t nstrings = 0;
+
+static int by_time(const void *a, const void *b)
+{
+	const struct event *x = a, *y = b;
+
+	if (x->rec.ts != y->rec.ts)
+		return x->rec.ts < y->rec.ts ? -1 : 1;
+	return x->order < y->order ? -1 : 1;
+}
+
+static const char *string_of(uint64_t addr)
+{
+	size_t i;
+
+	for (i = nstrings; i > 0; i--){
+		if (strings[i - 1].addr == addr)
+			return strings[i - 1].text;
+	}
+	return NULL;
+}
+
+/*----- A message, %s is the errno and %d the ints that follow -----*/
+static void print_msg(const struct trace_rec *r)
+{
+	const char *fmt = string_of((uint64_t)r->arg[1] << 32 | r->arg[0]);
+	int n = 3;
+
+	if (fmt == NULL){
+		printf("message with a lost format");
+		return;
+	}
+	for (; *fmt != '\0'; fmt++){
+		if (*fmt != '%'){
+			putchar(*fmt);
+			continue;
+		}
+		switch (*(++fmt)){
+			case 's':
+				printf("%s", r->arg[2] == 0 ? "None" : strerror(r->arg[2]));
+				break;
+			case 'd':
+				printf("%d", n < 5 ? (int)r->arg[n++] : 0);
+				break;
+			case '\0':
+				return;
+			default:
+				putchar(*fmt);
+		}
+	}
+}
+
+int main(int argc, char *argv[]){
+	FILE *in;
+	struct trace_rec r, start;
+	struct event *events = NULL;
+	size_t n = 0, cap = 0, i, len;
+	time_t wall;
+	char when[64];
+
+	if (argc != 2){
+		fprintf(stderr, "usage: tracedump <trace file>\n");
+		exit(-1);
+	}
+	if ((in = fopen(argv[1], "rb")) == NULL){
+		perror("fopen");
+		exit(-1);
+	}
+	if (fread(&start, sizeof(start), 1, in) != 1 || start.id != TR_START || start.arg[4] != TRACE_MAGIC){
+		fprintf(stderr, "tracedump: %s is not a trace\n", argv[1]);
+		exit(-1);
+	}
+
+	/*----- Reading the events, the strings are kept aside -----*/
+	while (fread(&r, sizeof(r), 1, in) == 1){
+		if (r.id == TR_STRING){
+			len = (r.arg[2] + sizeof(r) - 1) / sizeof(r) * sizeof(r);
+			if ((strings = realloc(strings, (nstrings + 1) * sizeof(*strings))) == NULL ||
+			    (strings[nstrings].text = malloc(len)) == NULL){
+				perror("malloc");
+				exit(-1);
+			}
+			if (fread(strings[nstrings].text, 1, len, in) != len)
+				break;
+			strings[nstrings].text[r.arg[2] - 1] = '\0';
+			strings[nstrings++].addr = (uint64_t)r.arg[1] << 32 | r.arg[0];
+			continue;
+		}
+		if (n == cap){
+			cap = cap == 0 ? 4096 : cap * 2;
+			if ((events = realloc(events, cap * sizeof(*events))) == NULL){
+				perror("realloc");
+				exit(-1);
+			}
+		}
+		events[n].rec = r;
+		events[n].order = n;
+		n++;
+	}
+	fclose(in);
+
+	/*----- Every thread wrote its own ring, merging them by time -----*/
+	qsort(events, n, sizeof(*events), by_time);
+	wall = (time_t)((uint64_t)start.arg[1] << 32 | start.arg[0]);
+	strftime(when, sizeof(when), "%a, %d %b %Y %X %Z", gmtime(&wall));
+	printf("pid %u started tracing %s, %lu events\n", start.arg[3], when, (unsigned long)n);
+	for (i = 0; i < n; i++){
+		const struct trace_rec *e = &events[i].rec;
+		int64_t dt = (int64_t)(e->ts - start.ts);
+
+		printf("%4lld.%06lld t%-3u ", (long long)(dt / 1000000000), (long long)(dt % 1000000000 / 1000), e->thread);
+		if (e->id == TR_MSG)
+			print_msg(e);
+		else if (e->id < TR_COUNT && formats[e->id] != NULL)
+			printf(formats[e->id], e->arg[0], e->arg[1], e->arg[2], e->arg[3], e->arg[4]);
+		else
+			printf("event %u %u %u %u %u %u", e->id, e->arg[0], e->arg[1], e->arg[2], e->arg[3], e->arg[4]);
+		putchar('\n');
+	}
+	return 0;
+}